@@ -0,0 +1,71 @@
+#!/bin/bash
+#
+# bench.sh - Time regdump against synthetic hives.
+#
+# Builds regdump and mkhive (with $CC and $CFLAGS), generates hives of
+# different shapes (the last with its cells scattered, as in an old hive)
+# and times each phase, reporting the best of $RUNS:
+#
+#   load    loading the hive (looking for a key that isn't there)
+#   walk    walking every key without writing anything ("--since" the future)
+#   text, ndjson, bin
+#	    the whole dump in each output format
+#
+# MB/s is of the hive, values/s of all its values.  Extra arguments are passed
+# to regdump (e.g. "-j 4").
+
+cd "$(dirname "$0")" || exit 1
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+RUNS=${RUNS:-3}
+args=("$@")
+OUT=${OUT:-/tmp/regdump-bench}
+
+mkdir -p "$OUT" || exit 1
+$CC $CFLAGS -pthread -o "$OUT/regdump" ../regdump.c ../regf.c || exit 1
+$CC $CFLAGS -o "$OUT/mkhive" mkhive.c || exit 1
+
+# Name and mkhive options of each shape.
+shapes=(
+  "wide    -d 2 -f 300 -n 5"
+  "deep    -d 7 -f 4 -n 5"
+  "ri      -d 3 -f 40 -n 5 -r"
+  "li      -d 3 -f 40 -n 5 -l li"
+  "strings -d 3 -f 30 -n 10 -m sm -u 50"
+  "numbers -d 3 -f 30 -n 10 -m dqf"
+  "big     -d 2 -f 20 -n 4 -b 2 -B 100000"
+  "scatter -d 3 -f 60 -n 5 -s 4096"
+)
+
+# Print the best time of running regdump with the given arguments.
+best()
+{
+  local i t min=
+  for ((i = 0; i < RUNS; ++i)); do
+    t=$( { TIMEFORMAT=%R; time "$OUT/regdump" "$@" >/dev/null 2>&1; } 2>&1 )
+    if [[ -z $min ]] || awk "BEGIN { exit !($t < $min) }"; then
+      min=$t
+    fi
+  done
+  echo "$min"
+}
+
+printf "%-8s %-7s %8s %10s %12s\n" shape phase seconds MB/s values/s
+for shape in "${shapes[@]}"; do
+  set -- $shape
+  name=$1; shift
+  hive=$OUT/$name.hiv
+  info=$("$OUT/mkhive" "$@" "$hive" 2>&1) || { echo "$info"; exit 1; }
+  values=$(echo "$info" | awk '{ print $3 }')
+  bytes=$(echo "$info" | awk '{ print $5 }')
+  for phase in load walk text ndjson bin; do
+    case $phase in
+      load) t=$(best -p /nonexistent "${args[@]}" "$hive");;
+      walk) t=$(best --since 3000-01-01 "${args[@]}" "$hive");;
+      *)    t=$(best -o $phase "${args[@]}" "$hive");;
+    esac
+    awk -v n="$name" -v p="$phase" -v t="$t" -v b="$bytes" -v v="$values" \
+      'BEGIN { if (t <= 0) t = 0.001;
+	       printf "%-8s %-7s %8.3f %10.1f %12.0f\n", n, p, t, b / t / 1e6, v / t }'
+  done
+done
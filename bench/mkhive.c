@@ -0,0 +1,527 @@
+/*
+  mkhive.c - Generate a synthetic registry hive.
+
+  Writes a regf file of a controllable shape, for measuring regdump.
+
+  The tree is DEPTH levels below the root, each key having FANOUT subkeys
+  and VALUES values.  Subkey lists are "lh" by default ("lf" or "li" can be
+  selected); if a list would exceed 500 entries, or "-r" is given, it is split
+  into an "ri" list of smaller lists.  Values rotate through the types given
+  by the mix string (s=REG_SZ, m=REG_MULTI_SZ, d=REG_DWORD, q=REG_QWORD,
+  b=REG_BINARY, t=binary text, f=FILETIME, p/o/w=device property string,
+  boolean and uint16, D=DWORD with a high word), with every BIGth value (if given)
+  being big data of BIGSIZE bytes.  PCT percent of the names will contain
+  non-ASCII characters.  Cells are allocated in order, unless LANES is given:
+  each cell then goes in one of that many bins at random, so related cells
+  end up far apart, as in a hive that has been written to for years.
+*/
+
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+static unsigned char* image;
+static unsigned image_size, used;	// used is relative to the hbins
+static unsigned hbin_start, hbin_end;
+static unsigned top;			// end of the last hbin
+
+#define MAX_LANES 0x10000
+static int  lanes, lane;
+static unsigned lane_used[MAX_LANES], lane_end[MAX_LANES];
+
+static int  depth = 3, fanout = 10, values = 5, ri_list, pct, big, big_size;
+static int  special;
+static char list_type[3] = "lh";
+static const char* mix = "sdbmqtf";
+static unsigned seed = 1;
+static unsigned keys_made, values_made;
+
+
+static unsigned rnd( void )
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+
+static void put32( unsigned off, int v )
+{
+  memcpy( image + 0x1000 + off, &v, 4 );
+}
+
+
+static void put16( unsigned off, short v )
+{
+  memcpy( image + 0x1000 + off, &v, 2 );
+}
+
+
+static void close_hbin( void )
+{
+  if (hbin_end > used)
+    put32( used, hbin_end - used );	// free cell for the remainder
+}
+
+
+static void new_hbin( unsigned size )
+{
+  close_hbin();
+  hbin_start = top;
+  hbin_end = top = hbin_start + size;
+  if (0x1000 + hbin_end > image_size)
+  {
+    unsigned old = image_size;
+    while (0x1000 + hbin_end > image_size)
+      image_size *= 2;
+    image = realloc( image, image_size );
+    memset( image + old, 0, image_size - old );
+  }
+  memcpy( image + 0x1000 + hbin_start, "hbin", 4 );
+  put32( hbin_start + 4, hbin_start );
+  put32( hbin_start + 8, size );
+  used = hbin_start + 32;
+}
+
+
+// Allocate a cell able to hold SIZE bytes (excluding the size field).
+static unsigned cell( unsigned size )
+{
+  unsigned off;
+
+  size = (size + 4 + 7) & ~7;
+  if (lanes)
+  {
+    lane_used[lane] = used;
+    lane_end[lane] = hbin_end;
+    lane = rnd() % lanes;
+    used = lane_used[lane];
+    hbin_end = lane_end[lane];
+  }
+  if (used + size > hbin_end)
+    new_hbin( (size + 32 + 0xFFF) & ~0xFFF );
+  off = used;
+  used += size;
+  put32( off, -(int)size );
+  return off;
+}
+
+
+static unsigned lh_hash( const unsigned short* name, int len )
+{
+  unsigned h = 0;
+  int i;
+
+  for (i = 0; i < len; ++i)
+    h = h * 37 + ((name[i] >= 'a' && name[i] <= 'z') ? name[i] - 32 : name[i]);
+  return h;
+}
+
+
+typedef struct
+{
+  unsigned short name[32];
+  int len;
+  unsigned off;
+} child;
+
+
+static int by_name( const void* a, const void* b )
+{
+  const child* ca = a;
+  const child* cb = b;
+  int i;
+
+  for (i = 0; i < ca->len && i < cb->len; ++i)
+  {
+    int x = ca->name[i], y = cb->name[i];
+    if (x >= 'a' && x <= 'z') x -= 32;
+    if (y >= 'a' && y <= 'z') y -= 32;
+    if (x != y)
+      return x - y;
+  }
+  return ca->len - cb->len;
+}
+
+
+// Store a name, compressed if it is all ASCII; return the flag to use.
+static int put_name( unsigned off, const unsigned short* name, int len,
+		     int* bytes )
+{
+  int i, wide = 0;
+
+  for (i = 0; i < len; ++i)
+    if (name[i] > 0xFF)
+      wide = 1;
+  if (wide)
+  {
+    memcpy( image + 0x1000 + off, name, len * 2 );
+    *bytes = len * 2;
+    return 0;
+  }
+  for (i = 0; i < len; ++i)
+    image[0x1000 + off + i] = (unsigned char)name[i];
+  *bytes = len;
+  return 1;
+}
+
+
+static int make_name( unsigned short* name, const char* base, int n )
+{
+  char s[32];
+  int len = sprintf( s, "%s%d", base, n );
+  int i;
+
+  for (i = 0; i < len; ++i)
+    name[i] = (unsigned char)s[i];
+  if (pct && (int)(rnd() % 100) < pct)
+    name[len++] = (rnd() & 1) ? 0xE9 : 0x263A;
+  return len;
+}
+
+
+static unsigned make_data( int size, const void* src )
+{
+  unsigned off;
+
+  if (size > 16344 && big_size)
+  {
+    int segs = (size + 16343) / 16344;
+    unsigned db = cell( 8 ), list = cell( segs * 4 );
+    int i;
+
+    memcpy( image + 0x1000 + db + 4, "db", 2 );
+    put16( db + 6, (short)segs );
+    put32( db + 8, list );
+    for (i = 0; i < segs; ++i)
+    {
+      int len = (size - i * 16344 > 16344) ? 16344 : size - i * 16344;
+      unsigned seg = cell( len );
+      memcpy( image + 0x1000 + seg + 4, (const char*)src + i * 16344, len );
+      put32( list + 4 + i * 4, seg );
+    }
+    return db;
+  }
+  off = cell( size );
+  memcpy( image + 0x1000 + off + 4, src, size );
+  return off;
+}
+
+
+static unsigned make_value( int n )
+{
+  unsigned short name[32];
+  unsigned char data[256], *bigbuf = NULL;
+  int len = make_name( name, "Value", n ), bytes, flag;
+  int type, size = 0, i;
+  unsigned off = cell( 20 + len * 2 );
+  char c = mix[n % strlen( mix )];
+
+  memcpy( image + 0x1000 + off + 4, "vk", 2 );
+  flag = put_name( off + 24, name, len, &bytes );
+  put16( off + 6, (short)bytes );
+  put16( off + 20, (short)flag );
+
+  if (big && big_size && n % big == big - 1)
+  {
+    type = 3;
+    size = big_size;
+    bigbuf = malloc( size );
+    for (i = 0; i < size; ++i)
+      bigbuf[i] = (unsigned char)rnd();
+  }
+  else switch (c)
+  {
+    case 's':
+    case 'm':
+      type = (c == 's') ? 1 : 7;
+      for (i = 0; i < 20; ++i)
+	((unsigned short*)data)[i] = 'a' + (rnd() % 26);
+      ((unsigned short*)data)[10] = (c == 's') ? ' ' : 0;
+      ((unsigned short*)data)[20] = 0;
+      ((unsigned short*)data)[21] = 0;
+      size = (c == 's') ? 42 : 44;
+      break;
+    case 'd':
+      type = 4;
+      size = 4;
+      i = rnd();
+      memcpy( data, &i, 4 );
+      break;
+    case 'q':
+    case 'f':
+    {
+      int64_t q = (c == 'f') ? (int64_t)131000000000000000 + rnd() * 10000000LL
+			     : (int64_t)rnd() << 20;
+      type = (c == 'f') ? 3 : 11;
+      size = 8;
+      memcpy( data, &q, 8 );
+      break;
+    }
+    case 'p':				// DEVPROP_TYPE_STRING
+      type = 0xFFFF0012;
+      for (i = 0; i < 8; ++i)
+	((unsigned short*)data)[i] = 'A' + (rnd() % 26);
+      size = 16;
+      break;
+    case 'o':				// DEVPROP_TYPE_BOOLEAN
+      type = 0xFFFF0011;
+      size = 1;
+      data[0] = (rnd() & 1) ? 0xFF : 0;
+      break;
+    case 'w':				// DEVPROP_TYPE_UINT16
+      type = 0xFFFF0005;
+      size = 2;
+      data[0] = (unsigned char)rnd();
+      data[1] = (unsigned char)rnd();
+      break;
+    case 'D':				// DriverPackages DWORD
+      type = 0x00210004;
+      size = 4;
+      i = rnd();
+      memcpy( data, &i, 4 );
+      break;
+    case 't':
+      type = 3;
+      size = 40;
+      for (i = 0; i < size; ++i)
+	data[i] = 'A' + (rnd() % 26);
+      break;
+    default:
+      type = 3;
+      size = 16 + rnd() % 200;
+      for (i = 0; i < size; ++i)
+	data[i] = (unsigned char)rnd();
+      break;
+  }
+  put32( off + 16, type );
+  if (size <= 4)
+  {
+    put32( off + 8, size | (int)0x80000000 );
+    memcpy( image + 0x1000 + off + 12, data, size );
+  }
+  else
+  {
+    unsigned d = make_data( size, bigbuf ? bigbuf : data );
+    put32( off + 8, size );
+    put32( off + 12, d );
+  }
+  free( bigbuf );
+  ++values_made;
+  return off;
+}
+
+
+static unsigned make_list( child* kids, int count, const char* type )
+{
+  int ii = (type[1] == 'i') ? 1 : 2;
+  unsigned off = cell( 4 + count * ii * 4 );
+  int i;
+
+  memcpy( image + 0x1000 + off + 4, type, 2 );
+  put16( off + 6, (short)count );
+  for (i = 0; i < count; ++i)
+  {
+    put32( off + 8 + i * ii * 4, kids[i].off );
+    if (ii == 2)
+    {
+      int h = 0;
+      if (type[1] == 'h')
+	h = lh_hash( kids[i].name, kids[i].len );
+      else
+      {
+	int j;
+	char hint[4] = { 0 };
+	for (j = 0; j < 4 && j < kids[i].len; ++j)
+	  hint[j] = (char)kids[i].name[j];
+	memcpy( &h, hint, 4 );
+      }
+      put32( off + 12 + i * 8, h );
+    }
+  }
+  return off;
+}
+
+
+static unsigned make_key( const unsigned short* name, int len, unsigned parent,
+			  int level )
+{
+  unsigned off = cell( 76 + len * 2 );
+  int bytes, flag, i;
+  int64_t ts = (int64_t)131000000000000000 + (int64_t)rnd() * 100000000;
+
+  ++keys_made;
+  memcpy( image + 0x1000 + off + 4, "nk", 2 );
+  flag = put_name( off + 80, name, len, &bytes );
+  put16( off + 6, (short)((flag ? 0x20 : 0) | (level ? 0 : 4)) );
+  memcpy( image + 0x1000 + off + 8, &ts, 8 );
+  put32( off + 20, parent );
+  put32( off + 32, -1 );		// subkeys
+  put32( off + 36, -1 );		// volatile subkeys
+  put32( off + 44, -1 );		// values
+  put32( off + 48, -1 );		// security
+  put32( off + 52, -1 );		// class name
+  put16( off + 76, (short)bytes );
+
+  if (values && level > 0)
+  {
+    unsigned list = cell( values * 4 );
+    for (i = 0; i < values; ++i)
+    {
+      unsigned v = make_value( i );
+      put32( list + 4 + i * 4, v );
+    }
+    put32( off + 40, values );
+    put32( off + 44, list );
+  }
+
+  if (level < depth)
+  {
+    child* kids = malloc( fanout * sizeof(child) );
+    unsigned list;
+    for (i = 0; i < fanout; ++i)
+    {
+      kids[i].len = make_name( kids[i].name, "Key", i );
+      if (special && level == 0 && i < 2)
+      {
+	const char* nm = (i == 0) ? "Properties" : "DriverPackages";
+	for (kids[i].len = 0; nm[kids[i].len]; ++kids[i].len)
+	  kids[i].name[kids[i].len] = nm[kids[i].len];
+      }
+      kids[i].off = make_key( kids[i].name, kids[i].len, off, level + 1 );
+    }
+    qsort( kids, fanout, sizeof(child), by_name );
+    if (ri_list || fanout > 500)
+    {
+      int per = ri_list ? (fanout + 3) / 4 : 500;
+      int n = (fanout + per - 1) / per;
+      child* subs = malloc( n * sizeof(child) );
+      for (i = 0; i < n; ++i)
+      {
+	int cnt = (fanout - i * per < per) ? fanout - i * per : per;
+	subs[i].off = make_list( kids + i * per, cnt, list_type );
+      }
+      list = cell( 4 + n * 4 );
+      memcpy( image + 0x1000 + list + 4, "ri", 2 );
+      put16( list + 6, (short)n );
+      for (i = 0; i < n; ++i)
+	put32( list + 8 + i * 4, subs[i].off );
+      free( subs );
+    }
+    else
+      list = make_list( kids, fanout, list_type );
+    put32( off + 24, fanout );
+    put32( off + 32, list );
+    free( kids );
+  }
+  return off;
+}
+
+
+int main( int argc, char* argv[] )
+{
+  unsigned short name[32];
+  unsigned root_off, sum;
+  FILE* f;
+  int	i;
+
+  if (argc == 1 || strcmp( argv[1], "--help" ) == 0)
+  {
+    printf( "Generate a synthetic registry hive.\n"
+	    "\n"
+	    "mkhive [-d DEPTH] [-f FANOUT] [-n VALUES] [-l lf|lh|li] [-p] [-r]\n"
+	    "       [-m MIX] [-b BIG -B BIGSIZE] [-u PCT] [-s LANES] [-S SEED] FILE\n"
+	    "\n"
+	    "-b  every BIGth value is big data\n"
+	    "-B  size of big data values (bytes)\n"
+	    "-d  depth of the tree below the root (default 3)\n"
+	    "-f  subkeys per key (default 10)\n"
+	    "-l  type of subkey list (default lh)\n"
+	    "-m  value type mix (default sdbmqtf)\n"
+	    "-n  values per key (default 5)\n"
+	    "-p  name the first two keys Properties and DriverPackages\n"
+	    "-r  always use ri lists\n"
+	    "-s  scatter the cells over LANES bins at random\n"
+	    "-S  random seed\n"
+	    "-u  percentage of names with non-ASCII characters\n"
+	  );
+    return 0;
+  }
+
+  for (i = 1; i < argc - 1; ++i)
+  {
+    const char* arg = (i + 1 < argc - 1) ? argv[i+1] : "";
+    if (argv[i][0] != '-')
+      break;
+    switch (argv[i][1])
+    {
+      case 'd': depth	 = atoi( arg ); ++i; break;
+      case 'f': fanout	 = atoi( arg ); ++i; break;
+      case 'n': values	 = atoi( arg ); ++i; break;
+      case 'b': big	 = atoi( arg ); ++i; break;
+      case 'B': big_size = atoi( arg ); ++i; break;
+      case 'u': pct	 = atoi( arg ); ++i; break;
+      case 's': lanes	 = atoi( arg ); ++i; break;
+      case 'S': seed	 = atoi( arg ); ++i; break;
+      case 'm': mix	 = arg; ++i; break;
+      case 'l': strncpy( list_type, arg, 2 ); ++i; break;
+      case 'r': ri_list  = 1; break;
+      case 'p': special  = 1; break;
+      default:
+	fprintf( stderr, "%s: unknown option.\n", argv[i] );
+	return 1;
+    }
+  }
+  if (i != argc - 1)
+  {
+    fprintf( stderr, "mkhive: missing FILE.\n" );
+    return 1;
+  }
+  if (lanes < 0 || lanes > MAX_LANES)
+  {
+    fprintf( stderr, "mkhive: LANES is at most %d.\n", MAX_LANES );
+    return 1;
+  }
+
+  image_size = 0x10000;
+  image = calloc( image_size, 1 );
+  new_hbin( 0x1000 );
+  for (i = 0; i < 4; ++i)
+    name[i] = "ROOT"[i];
+  root_off = make_key( name, 4, -1, 0 );
+  if (lanes)
+  {
+    lane_used[lane] = used;
+    lane_end[lane] = hbin_end;
+    for (i = 0; i < lanes; ++i)
+    {
+      used = lane_used[i];
+      hbin_end = lane_end[i];
+      close_hbin();
+    }
+  }
+  else
+    close_hbin();
+
+  memcpy( image, "regf", 4 );
+  memcpy( image + 4, "\1\0\0\0\1\0\0\0", 8 );
+  memcpy( image + 20, "\1\0\0\0\5\0\0\0\0\0\0\0\1\0\0\0", 16 );
+  memcpy( image + 36, &root_off, 4 );
+  memcpy( image + 40, &top, 4 );
+  image[44] = 1;
+  for (sum = 0, i = 0; i < 0x1FC; i += 4)
+    sum ^= *(unsigned*)(image + i);
+  memcpy( image + 0x1FC, &sum, 4 );
+
+  f = fopen( argv[argc-1], "wb" );
+  if (!f || fwrite( image, 0x1000 + top, 1, f ) != 1)
+  {
+    perror( argv[argc-1] );
+    return 1;
+  }
+  fclose( f );
+  fprintf( stderr, "%u keys, %u values, %u bytes\n",
+	   keys_made, values_made, 0x1000 + top );
+  return 0;
+}
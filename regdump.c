@@ -6,7 +6,8 @@
 
   Dump one or more registry hives as text, one line per value.	Normally values
   and empty keys are written; use "-v" to only show values, or "-k" to only
-  show keys (along with the time of last write).
+  show keys (along with the time of last write).  If the output can't all be
+  written (to a full disk, say), it exits with 1.
 
   Key names, value names and strings will only use ASCII characters, other
   characters will be written as "<XX>" or "<XXXX>", using the hexadecimal code
@@ -28,108 +29,184 @@
   type.  Types under the "DriverPackages" key will mask out the high word,
   resulting in a standard type.
 
-  Note: assumes the hive and CPU are little-endian.
+  Use "--max-data N" to only write the first "N" bytes of each value's data,
+  followed by "<+M more>" for the "M" bytes left out (NDJSON has a "more" field,
+  with "size" still the whole size).  It only cuts strings, text and hex (a
+  string at an even byte), which are written as they would be if whole; numbers
+  and times are always complete.  Only what's written is read (besides seeing
+  if binary data is text), so most of a large big data value is skipped.
+  Binary records are always complete.
 
-  References:
+  Use "-g" to group the values of each key: the key is written once (with its
+  time), followed by its values indented, as "  NAME [TYPE:SIZE] = DATA".  Keys
+  with many values no longer repeat the path on every line.
 
-  https://www.codeproject.com/KB/recipes/RegistryDumper.aspx
-  https://github.com/msuhanov/regf/blob/master/Windows%20registry%20file%20format%20specification.md
-*/
+  Use "--security" to write the security descriptors.  Each one in the
+  hive is written once, before the keys, as "[sk:OFFSET] = SDDL" (OFFSET
+  being that of its cell, in hexadecimal; NDJSON adds its count of keys), and
+  every key has a line, ending with "[sk:OFFSET]" of its descriptor.  SIDs
+  are only named when well known.  Binary records don't have them.
 
-#ifdef _WIN32
-# define _CRT_SECURE_NO_WARNINGS
-# define WIN32_LEAN_AND_MEAN
-# include <windows.h>
-# define int64_t __int64
-# define PRId64 "I64d"
-# define PRIX64 "I64X"
-#else
-# include <inttypes.h>
-# include <time.h>
-  typedef int  BOOL;
-# define TRUE  1
-# define FALSE 0
-#endif
-#include <string.h>
-#include <stdio.h>
-#include <stdlib.h>
+  Use "-o ndjson" or "-o bin" for output to be read by other programs.  Each
+  hive, key (as would be written) and value is a record, with names in UTF-8,
+  the raw type and the key's timestamp (as a FILETIME).  The data is written
+  as is, encoded as base64 for NDJSON.  Binary records start with a letter,
+  followed by little-endian numbers and then the strings and data:
 
+    'H'  u32 name length, name
+    'K'  u64 time, u32 path length, path
+    'V'  u64 time, u32 type, u32 path length, u32 name length, u32 data size,
+	 path, name, data
 
-BOOL hex_type, only_values, only_keys, all_string, time_sec, time_full;
-BOOL big_data;
+  Use "-p PATH" to only dump the key PATH and its subkeys; it may be given more
+  than once.  The path is written as it would be output (starting with the
+  root key), but case is ignored.  The hashes of the subkey lists are used to
+  go straight to the key, without walking the rest of the hive.
 
+  Add "-I" to use an index of the key paths, kept beside the hive as
+  "HIVE.idx" (the index is created, or recreated if the hive has been written
+  since, when needed).  The key is then found by a binary search.
 
-typedef struct
-{
-  char signature[4];		// "regf"
-  int  primary_sequence_number;
-  int  secondary_sequence_number;
-  int  last_written_timestamp[2];	// avoid alignment issues with int64_t
-  int  major_version;
-  int  minor_version;
-  int  file_type;
-  int  file_format;
-  int  root_cell_offset;
-  // and more of no interest
-} base_block;
+  Use "--diff OLD NEW" to compare two hives, writing the lines that have been
+  removed from OLD (starting with "- ") and added to NEW ("+ "); a changed
+  value has both.  Keys are matched by name, so a whole key that has been
+  added or removed is written with all its subkeys.  The values of a key are
+  only compared if its time or number of values differ, since changing a
+  value updates the time of its key.
 
+  Use "--scan" to go through every cell in file order, rather than walking
+  the keys, to recover the keys and values that are no longer linked or have
+  been freed (deleted).  Each cell is a line of its offset (in the hive bins),
+  "used" or "free", its signature ("--" for data) and size; keys and values
+  add their usual line.  The path of a key is rebuilt from its parents
+  (starting with "?" if they don't reach the root); a value has the path of a
+  key listing it, or just "?".
 
-typedef struct
-{
-  int block_size;
-  int offsets[1];
-} offsets;
+  Use "--since TIME" to only dump the keys written after TIME, either local
+  "YYYY-MM-DD [HH:MM[:SS]]" or a FILETIME.  Older keys are still walked, since
+  their subkeys may be newer, but nothing of them is written.  Alternatively,
+  use "--state FILE" to remember when each hive was dumped, and only dump the
+  keys written since then; a hive that hasn't been written at all is skipped.
+  The file has a line for each hive: its two sequence numbers, its time of
+  last write (as a FILETIME) and its name.
 
+  Use "--serve" to keep hives loaded and answer requests for their keys,
+  read one per line from the standard input (so many lookups need only the one
+  process).  A request is fields separated by tabs:
 
-typedef struct
-{
-  int	block_size;
-  char	block_type[2];		// "lf" "lh" "li" "ri" "db"
-  short count;
-  int	offsets[1];
-  int	hash;			// only for "lf" "lh", ignored
-} list_block;
+    key    HIVE  PATH        the key and its values
+    tree   HIVE  PATH        the key and all its subkeys (like "-p")
+    since  TIME  HIVE  PATH  the keys of the tree written after TIME
 
+  A missing PATH is the root.  Each answer is written as the dump would be,
+  followed by an empty line (errors go to stderr).  The hives given are loaded
+  at the start and any others when first named; a hive is loaded again when
+  its sequence numbers (or size) change, which are only looked at again when
+  the file's time (to the nanosecond, where the system has it) or size does.
+  The index is used with "-I".
 
-typedef struct
-{
-  int	  block_size;
-  char	  block_type[2];	// "nk"
-  short   flags;
-  int64_t timestamp;
-  char	  dummya[8];
-  int	  subkey_count;
-  char	  dummyb[4];
-  int	  subkeys;
-  char	  dummyc[4];
-  int	  value_count;
-  int	  values;
-  char	  dummyd[28];
-  short   len;
-  short   du;
-  char	  name[1];
-} key_block;
+  A hive that wasn't cleanly written (its sequence numbers differ) has its
+  transaction logs ("HIVE.LOG1" and "HIVE.LOG2") replayed in memory first, as
+  Windows does when it loads it; neither file is changed.  Only the logs of
+  Windows 8.1 and later are understood.  Use "--raw" to dump the hive as it is.
 
+  A corrupt hive is still dumped as far as it can be: a key, list or value
+  whose cell isn't within the hive is reported (to stderr) and skipped, along
+  with its subkeys.  Hives of up to 4GiB are supported.
 
-typedef struct
-{
-  int	block_size;
-  char	block_type[2];		// "vk"
-  short name_len;
-  int	size;
-  int	offset;
-  int	value_type;
-  short flags;
-  short dummy;
-  char	name[1];
-} value_block;
+  A HIVE of "-" is read from the standard input, which may be a pipe (there
+  are no transaction logs or index for it).
+
+  Use "-j N" to walk the hive with N threads.  The subkeys of the root (and
+  their subkeys) are shared among the threads, with the output remaining the
+  same as a single thread.  When more than one hive is given, the next is
+  loaded while the current one is walked; with "-j", several hives may be
+  walked at once, still being written in order.
 
+  Use "--batch FILE" to also dump the hives named in FILE, one per line
+  ("-" being the standard input), and "-r DIR" to also dump every hive in
+  DIR and its subdirectories (in order of name, without following links); only
+  files starting with "regf" that aren't logs are taken.  These hives come
+  before any on the command line and are written like them, each after a line
+  of its name.
 
-#define KEY_COMP_NAME	0x20
-#define VALUE_COMP_NAME 0x01
+  Use "-z METHOD" to compress the output, with "gzip" or "zstd", optionally
+  followed by ":LEVEL" ("-z gzip:1" is much faster than the default level).
+  The levels are 0 to 9 for gzip, and those of the zstd library for zstd
+  (whose negative levels are the fastest).  It is done by a thread of its
+  own, so the hive is walked while the previous output is compressed and
+  written.  Each method is only available if built with "-DHAVE_ZLIB -lz"
+  or "-DHAVE_ZSTD -lzstd".
 
+  Use "--stats" to report to stderr, once everything is written, the number
+  of keys, values and big data segments, the bytes read and written, the
+  largest value and the deepest key, along with the wall and CPU time spent
+  loading, walking, formatting and flushing.  With "-j" the times of the
+  threads are added together.
 
-#ifndef _WIN32
+  The hive itself is read by regf.c, which is built along with this file
+  ("cc -O2 -pthread regdump.c regf.c"); it can also be built as a library of
+  its own for other programs, which walk the hive with a visitor (see regf.h).
+
+  Note: assumes the hive and CPU are little-endian.
+
+  References:
+
+  https://www.codeproject.com/KB/recipes/RegistryDumper.aspx
+  https://github.com/msuhanov/regf/blob/master/Windows%20registry%20file%20format%20specification.md
+*/
+
+// Let a 32-bit build still stat a hive of more than 2GiB.
+#define _FILE_OFFSET_BITS 64
+
+#ifdef _WIN32
+# define _CRT_SECURE_NO_WARNINGS
+# define WIN32_LEAN_AND_MEAN
+# include <windows.h>
+# include "regf.h"
+# include <io.h>
+# include <fcntl.h>
+# define PRId64 "I64d"
+# define SCNd64 "I64d"
+# define PRIX64 "I64X"
+  typedef HANDLE thread_t;
+  typedef CRITICAL_SECTION   mutex_t;
+  typedef CONDITION_VARIABLE cond_t;
+# define THREAD_FUNC DWORD WINAPI
+# define thread_create( t, f, a ) ((*(t) = CreateThread( NULL, 0, f, a, 0, NULL )) != NULL)
+# define thread_join( t )	(WaitForSingleObject( t, INFINITE ), CloseHandle( t ))
+# define mutex_init( m )	InitializeCriticalSection( m )
+# define mutex_destroy( m )	DeleteCriticalSection( m )
+# define mutex_lock( m )	EnterCriticalSection( m )
+# define mutex_unlock( m )	LeaveCriticalSection( m )
+# define cond_init( c )		InitializeConditionVariable( c )
+# define cond_destroy( c )
+# define cond_wait( c, m )	SleepConditionVariableCS( c, m, INFINITE )
+# define cond_broadcast( c )	WakeAllConditionVariable( c )
+#else
+# include "regf.h"
+# include <inttypes.h>
+# include <time.h>
+# include <pthread.h>
+# include <dirent.h>
+# include <sys/stat.h>
+  typedef pthread_t	  thread_t;
+  typedef pthread_mutex_t mutex_t;
+  typedef pthread_cond_t  cond_t;
+# define THREAD_FUNC void*
+# define thread_create( t, f, a ) (pthread_create( t, NULL, f, a ) == 0)
+# define thread_join( t )	pthread_join( t, NULL )
+# define mutex_init( m )	pthread_mutex_init( m, NULL )
+# define mutex_destroy( m )	pthread_mutex_destroy( m )
+# define mutex_lock( m )	pthread_mutex_lock( m )
+# define mutex_unlock( m )	pthread_mutex_unlock( m )
+# define cond_init( c )		pthread_cond_init( c, NULL )
+# define cond_destroy( c )	pthread_cond_destroy( c )
+# define cond_wait( c, m )	pthread_cond_wait( c, m )
+# define cond_broadcast( c )	pthread_cond_broadcast( c )
+  typedef int BOOL;
+# define TRUE  1
+# define FALSE 0
 enum
 {
   REG_NONE,
@@ -146,6 +223,46 @@ enum
   REG_QWORD
 };
 #endif
+#include <ctype.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+# define SIMD_X86
+# include <immintrin.h>
+# ifdef _MSC_VER
+#  include <intrin.h>
+#  define TARGET( isa )
+# else
+#  define TARGET( isa ) __attribute__((target( isa )))
+# endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+# define SIMD_NEON
+# include <arm_neon.h>
+#endif
+
+
+BOOL hex_type, only_values, only_keys, all_string, time_sec, time_full;
+BOOL group_values;		// write each key once, before its values
+BOOL show_security;		// write the security descriptors
+int  max_data = -1;		// bytes of data to write, or all
+BOOL raw_hive;			// don't replay the transaction logs
+int  jobs = 1;
+char** paths;			// the keys to dump, or NULL for all
+int  path_count;
+enum { FMT_TEXT, FMT_NDJSON, FMT_BIN } format;
+enum { COMPRESS_NONE, COMPRESS_GZIP, COMPRESS_ZSTD } compression;
+int  compress_level;
+BOOL have_level;		// otherwise the method's default
 
 
 enum
@@ -164,389 +281,4531 @@ enum
 };
 
 
-char* make_name( char* out, char* in, int len, int comp )
+void* xrealloc( void* p, size_t size )
+{
+  p = realloc( p, size );
+  if (!p)
+  {
+    fputs( "insufficient memory.\n", stderr );
+    exit( 1 );
+  }
+  return p;
+}
+
+
+// Nearly all names and strings are plain ASCII, so they are scanned a vector
+// at a time, only dropping to escaping for the characters that need it.  Each
+// scanner returns the number of leading printable (32 to 126) units; the
+// UTF-16 version also narrows them to OUT, which must have room for N.
+
+size_t ascii_span_c( const unsigned char* s, size_t n )
+{
+  size_t i;
+
+  for (i = 0; i < n && s[i] >= 32 && s[i] < 127; ++i) ;
+  return i;
+}
+
+
+size_t narrow_span_c( char* out, const unsigned short* s, size_t n )
+{
+  size_t i;
+
+  for (i = 0; i < n && s[i] >= 32 && s[i] < 127; ++i)
+    out[i] = (char)s[i];
+  return i;
+}
+
+
+#ifdef SIMD_X86
+
+int first_bit( unsigned m )
+{
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanForward( &i, m );
+  return (int)i;
+#else
+  return __builtin_ctz( m );
+#endif
+}
+
+
+// Signed compares also reject 128 to 255 (and 0x8000 to 0xFFFF).
+TARGET( "sse2" )
+size_t ascii_span_sse2( const unsigned char* s, size_t n )
+{
+  const __m128i lo = _mm_set1_epi8( 31 ), hi = _mm_set1_epi8( 127 );
+  size_t i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    __m128i v = _mm_loadu_si128( (const __m128i*)(s + i) );
+    unsigned m = _mm_movemask_epi8( _mm_and_si128( _mm_cmpgt_epi8( v, lo ),
+						   _mm_cmplt_epi8( v, hi ) ) );
+    if (m != 0xFFFF)
+      return i + first_bit( ~m );
+  }
+  return i + ascii_span_c( s + i, n - i );
+}
+
+
+TARGET( "sse2" )
+size_t narrow_span_sse2( char* out, const unsigned short* s, size_t n )
+{
+  const __m128i lo = _mm_set1_epi16( 31 ), hi = _mm_set1_epi16( 127 );
+  size_t i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    __m128i a  = _mm_loadu_si128( (const __m128i*)(s + i) );
+    __m128i b  = _mm_loadu_si128( (const __m128i*)(s + i + 8) );
+    __m128i ma = _mm_and_si128( _mm_cmpgt_epi16( a, lo ), _mm_cmplt_epi16( a, hi ) );
+    __m128i mb = _mm_and_si128( _mm_cmpgt_epi16( b, lo ), _mm_cmplt_epi16( b, hi ) );
+    unsigned m = _mm_movemask_epi8( _mm_packs_epi16( ma, mb ) );
+    _mm_storeu_si128( (__m128i*)(out + i), _mm_packus_epi16( a, b ) );
+    if (m != 0xFFFF)
+      return i + first_bit( ~m );
+  }
+  return i + narrow_span_c( out + i, s + i, n - i );
+}
+
+
+TARGET( "avx2" )
+size_t ascii_span_avx2( const unsigned char* s, size_t n )
+{
+  const __m256i lo = _mm256_set1_epi8( 31 ), hi = _mm256_set1_epi8( 127 );
+  size_t i;
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256( (const __m256i*)(s + i) );
+    unsigned m = _mm256_movemask_epi8( _mm256_and_si256( _mm256_cmpgt_epi8( v, lo ),
+							 _mm256_cmpgt_epi8( hi, v ) ) );
+    if (m != 0xFFFFFFFF)
+      return i + first_bit( ~m );
+  }
+  return i + ascii_span_sse2( s + i, n - i );
+}
+
+
+// Packing works within each 128-bit lane, so the quadwords need reordering.
+TARGET( "avx2" )
+size_t narrow_span_avx2( char* out, const unsigned short* s, size_t n )
+{
+  const __m256i lo = _mm256_set1_epi16( 31 ), hi = _mm256_set1_epi16( 127 );
+  size_t i;
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    __m256i a  = _mm256_loadu_si256( (const __m256i*)(s + i) );
+    __m256i b  = _mm256_loadu_si256( (const __m256i*)(s + i + 16) );
+    __m256i ma = _mm256_and_si256( _mm256_cmpgt_epi16( a, lo ), _mm256_cmpgt_epi16( hi, a ) );
+    __m256i mb = _mm256_and_si256( _mm256_cmpgt_epi16( b, lo ), _mm256_cmpgt_epi16( hi, b ) );
+    unsigned m = _mm256_movemask_epi8(
+		   _mm256_permute4x64_epi64( _mm256_packs_epi16( ma, mb ), 0xD8 ) );
+    _mm256_storeu_si256( (__m256i*)(out + i),
+			 _mm256_permute4x64_epi64( _mm256_packus_epi16( a, b ), 0xD8 ) );
+    if (m != 0xFFFFFFFF)
+      return i + first_bit( ~m );
+  }
+  return i + narrow_span_sse2( out + i, s + i, n - i );
+}
+
+#endif
+
+
+#ifdef SIMD_NEON
+
+size_t ascii_span_neon( const unsigned char* s, size_t n )
+{
+  const uint8x16_t lo = vdupq_n_u8( 32 ), hi = vdupq_n_u8( 127 );
+  size_t i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    uint8x16_t v = vld1q_u8( s + i );
+    if (vminvq_u8( vandq_u8( vcgeq_u8( v, lo ), vcltq_u8( v, hi ) ) ) != 0xFF)
+      break;
+  }
+  return i + ascii_span_c( s + i, n - i );
+}
+
+
+size_t narrow_span_neon( char* out, const unsigned short* s, size_t n )
+{
+  const uint16x8_t lo = vdupq_n_u16( 32 ), hi = vdupq_n_u16( 127 );
+  size_t i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    uint16x8_t a  = vld1q_u16( s + i );
+    uint16x8_t b  = vld1q_u16( s + i + 8 );
+    uint16x8_t ma = vandq_u16( vcgeq_u16( a, lo ), vcltq_u16( a, hi ) );
+    uint16x8_t mb = vandq_u16( vcgeq_u16( b, lo ), vcltq_u16( b, hi ) );
+    if (vminvq_u8( vcombine_u8( vmovn_u16( ma ), vmovn_u16( mb ) ) ) != 0xFF)
+      break;
+    vst1q_u8( (uint8_t*)out + i, vcombine_u8( vmovn_u16( a ), vmovn_u16( b ) ) );
+  }
+  return i + narrow_span_c( out + i, s + i, n - i );
+}
+
+#endif
+
+
+// Count the printable units, for deciding if binary data is really text.
+// Counting stops early (returning less than NEED) once there are too few
+// units left for the count to reach NEED.
+
+size_t count_ascii_c( const unsigned char* s, size_t n, size_t need )
+{
+  size_t count = 0, i, end;
+
+  for (i = 0; i < n; )
+  {
+    end = (n - i < 0x1000) ? n : i + 0x1000;
+    for (; i < end; ++i)
+      count += (s[i] >= 32 && s[i] < 127);
+    if (count + (n - i) < need)
+      break;
+  }
+  return count;
+}
+
+
+size_t count_ascii16_c( const unsigned short* s, size_t n, size_t need )
+{
+  size_t count = 0, i, end;
+
+  for (i = 0; i < n; )
+  {
+    end = (n - i < 0x1000) ? n : i + 0x1000;
+    for (; i < end; ++i)
+      count += (s[i] >= 32 && s[i] < 127);
+    if (count + (n - i) < need)
+      break;
+  }
+  return count;
+}
+
+
+#ifdef SIMD_X86
+
+// Each printable byte subtracts -1 from its lane, so up to 255 vectors can be
+// counted before the lanes are summed.
+TARGET( "sse2" )
+size_t count_ascii_sse2( const unsigned char* s, size_t n, size_t need )
+{
+  const __m128i lo = _mm_set1_epi8( 31 ), hi = _mm_set1_epi8( 127 );
+  size_t count = 0, i = 0, end;
+
+  while (n - i >= 16)
+  {
+    __m128i acc = _mm_setzero_si128();
+    end = (n - i < 255 * 16) ? n : i + 255 * 16;
+    for (; end - i >= 16; i += 16)
+    {
+      __m128i v = _mm_loadu_si128( (const __m128i*)(s + i) );
+      acc = _mm_sub_epi8( acc, _mm_and_si128( _mm_cmpgt_epi8( v, lo ),
+					      _mm_cmplt_epi8( v, hi ) ) );
+    }
+    acc = _mm_sad_epu8( acc, _mm_setzero_si128() );
+    count += _mm_cvtsi128_si32( acc ) + _mm_extract_epi16( acc, 4 );
+    if (count + (n - i) < need)
+      return count;
+  }
+  return count + count_ascii_c( s + i, n - i, 0 );
+}
+
+
+TARGET( "sse2" )
+size_t count_ascii16_sse2( const unsigned short* s, size_t n, size_t need )
+{
+  const __m128i lo = _mm_set1_epi16( 31 ), hi = _mm_set1_epi16( 127 );
+  size_t count = 0, i = 0, end;
+
+  while (n - i >= 16)
+  {
+    __m128i acc = _mm_setzero_si128();
+    end = (n - i < 255 * 16) ? n : i + 255 * 16;
+    for (; end - i >= 16; i += 16)
+    {
+      __m128i a = _mm_loadu_si128( (const __m128i*)(s + i) );
+      __m128i b = _mm_loadu_si128( (const __m128i*)(s + i + 8) );
+      acc = _mm_sub_epi8( acc, _mm_packs_epi16(
+		_mm_and_si128( _mm_cmpgt_epi16( a, lo ), _mm_cmplt_epi16( a, hi ) ),
+		_mm_and_si128( _mm_cmpgt_epi16( b, lo ), _mm_cmplt_epi16( b, hi ) ) ) );
+    }
+    acc = _mm_sad_epu8( acc, _mm_setzero_si128() );
+    count += _mm_cvtsi128_si32( acc ) + _mm_extract_epi16( acc, 4 );
+    if (count + (n - i) < need)
+      return count;
+  }
+  return count + count_ascii16_c( s + i, n - i, 0 );
+}
+
+
+TARGET( "avx2" )
+size_t sum_bytes_avx2( __m256i acc )
+{
+  __m128i sum;
+
+  acc = _mm256_sad_epu8( acc, _mm256_setzero_si256() );
+  sum = _mm_add_epi64( _mm256_castsi256_si128( acc ),
+		       _mm256_extracti128_si256( acc, 1 ) );
+  return _mm_cvtsi128_si32( sum ) + _mm_extract_epi16( sum, 4 );
+}
+
+
+TARGET( "avx2" )
+size_t count_ascii_avx2( const unsigned char* s, size_t n, size_t need )
+{
+  const __m256i lo = _mm256_set1_epi8( 31 ), hi = _mm256_set1_epi8( 127 );
+  size_t count = 0, i = 0, end;
+
+  while (n - i >= 32)
+  {
+    __m256i acc = _mm256_setzero_si256();
+    end = (n - i < 255 * 32) ? n : i + 255 * 32;
+    for (; end - i >= 32; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256( (const __m256i*)(s + i) );
+      acc = _mm256_sub_epi8( acc, _mm256_and_si256( _mm256_cmpgt_epi8( v, lo ),
+						    _mm256_cmpgt_epi8( hi, v ) ) );
+    }
+    count += sum_bytes_avx2( acc );
+    if (count + (n - i) < need)
+      return count;
+  }
+  return count + count_ascii_sse2( s + i, n - i, 0 );
+}
+
+
+TARGET( "avx2" )
+size_t count_ascii16_avx2( const unsigned short* s, size_t n, size_t need )
+{
+  const __m256i lo = _mm256_set1_epi16( 31 ), hi = _mm256_set1_epi16( 127 );
+  size_t count = 0, i = 0, end;
+
+  // The order of the lanes doesn't matter when counting.
+  while (n - i >= 32)
+  {
+    __m256i acc = _mm256_setzero_si256();
+    end = (n - i < 255 * 32) ? n : i + 255 * 32;
+    for (; end - i >= 32; i += 32)
+    {
+      __m256i a = _mm256_loadu_si256( (const __m256i*)(s + i) );
+      __m256i b = _mm256_loadu_si256( (const __m256i*)(s + i + 16) );
+      acc = _mm256_sub_epi8( acc, _mm256_packs_epi16(
+		_mm256_and_si256( _mm256_cmpgt_epi16( a, lo ), _mm256_cmpgt_epi16( hi, a ) ),
+		_mm256_and_si256( _mm256_cmpgt_epi16( b, lo ), _mm256_cmpgt_epi16( hi, b ) ) ) );
+    }
+    count += sum_bytes_avx2( acc );
+    if (count + (n - i) < need)
+      return count;
+  }
+  return count + count_ascii16_sse2( s + i, n - i, 0 );
+}
+
+#endif
+
+
+#ifdef SIMD_NEON
+
+size_t count_ascii_neon( const unsigned char* s, size_t n, size_t need )
+{
+  const uint8x16_t lo = vdupq_n_u8( 32 ), hi = vdupq_n_u8( 127 );
+  size_t count = 0, i = 0, end;
+
+  while (n - i >= 16)
+  {
+    uint8x16_t acc = vdupq_n_u8( 0 );
+    end = (n - i < 255 * 16) ? n : i + 255 * 16;
+    for (; end - i >= 16; i += 16)
+    {
+      uint8x16_t v = vld1q_u8( s + i );
+      acc = vsubq_u8( acc, vandq_u8( vcgeq_u8( v, lo ), vcltq_u8( v, hi ) ) );
+    }
+    count += vaddlvq_u8( acc );
+    if (count + (n - i) < need)
+      return count;
+  }
+  return count + count_ascii_c( s + i, n - i, 0 );
+}
+
+
+size_t count_ascii16_neon( const unsigned short* s, size_t n, size_t need )
+{
+  const uint16x8_t lo = vdupq_n_u16( 32 ), hi = vdupq_n_u16( 127 );
+  size_t count = 0, i = 0, end;
+
+  while (n - i >= 16)
+  {
+    uint8x16_t acc = vdupq_n_u8( 0 );
+    end = (n - i < 255 * 16) ? n : i + 255 * 16;
+    for (; end - i >= 16; i += 16)
+    {
+      uint16x8_t a = vld1q_u16( s + i );
+      uint16x8_t b = vld1q_u16( s + i + 8 );
+      acc = vsubq_u8( acc, vcombine_u8(
+		vmovn_u16( vandq_u16( vcgeq_u16( a, lo ), vcltq_u16( a, hi ) ) ),
+		vmovn_u16( vandq_u16( vcgeq_u16( b, lo ), vcltq_u16( b, hi ) ) ) ) );
+    }
+    count += vaddlvq_u8( acc );
+    if (count + (n - i) < need)
+      return count;
+  }
+  return count + count_ascii16_c( s + i, n - i, 0 );
+}
+
+#endif
+
+
+size_t (*ascii_span)( const unsigned char*, size_t ) = ascii_span_c;
+size_t (*narrow_span)( char*, const unsigned short*, size_t ) = narrow_span_c;
+size_t (*count_ascii)( const unsigned char*, size_t, size_t ) = count_ascii_c;
+size_t (*count_ascii16)( const unsigned short*, size_t, size_t ) = count_ascii16_c;
+
+
+// Select the scanners for this CPU.
+void init_simd( void )
+{
+#if defined(SIMD_X86)
+  BOOL sse2, avx2;
+# ifdef _MSC_VER
+  int r[4];
+  __cpuid( r, 1 );
+  sse2 = (r[3] & (1 << 26)) != 0;
+  // AVX2 also needs the OS to save the YMM registers.
+  avx2 = FALSE;
+  if ((r[2] & (1 << 27)) && (_xgetbv( 0 ) & 6) == 6)
+  {
+    __cpuid( r, 0 );
+    if (r[0] >= 7)
+    {
+      __cpuidex( r, 7, 0 );
+      avx2 = (r[1] & (1 << 5)) != 0;
+    }
+  }
+# else
+  __builtin_cpu_init();
+  sse2 = __builtin_cpu_supports( "sse2" );
+  avx2 = __builtin_cpu_supports( "avx2" );
+# endif
+  if (avx2)
+  {
+    ascii_span = ascii_span_avx2;
+    narrow_span = narrow_span_avx2;
+    count_ascii = count_ascii_avx2;
+    count_ascii16 = count_ascii16_avx2;
+  }
+  else if (sse2)
+  {
+    ascii_span = ascii_span_sse2;
+    narrow_span = narrow_span_sse2;
+    count_ascii = count_ascii_sse2;
+    count_ascii16 = count_ascii16_sse2;
+  }
+#elif defined(SIMD_NEON)
+  ascii_span = ascii_span_neon;
+  narrow_span = narrow_span_neon;
+  count_ascii = count_ascii_neon;
+  count_ascii16 = count_ascii16_neon;
+#endif
+}
+
+
+// Counts and times for "--stats".  Each walker has its own (the workers' are
+// added up as they finish), so nothing is shared while walking.  Formatting
+// is only timed on the wall clock, since the CPU time of a thread is a system
+// call; its CPU time is taken to be the same share of the walk's.
+enum { PHASE_LOAD, PHASE_WALK, PHASE_FORMAT, PHASE_FLUSH, PHASES };
+
+typedef struct
+{
+  uint64_t keys, values;
+  uint64_t chunks;		// "db" segments
+  uint64_t bytes_read, bytes_written;
+  int	   largest;		// size of the largest value
+  int	   deepest;		// depth of the deepest key
+  char*    deepest_path;
+  size_t   deepest_len;
+  int64_t  wall[PHASES], cpu[PHASES];	// nanoseconds
+} stats;
+
+typedef struct
+{
+  int64_t wall, cpu;
+} stamp;
+
+BOOL  show_stats;
+stats totals;
+
+
+// Return the elapsed time in nanoseconds, from a monotonic clock.
+int64_t wall_clock( void )
+{
+#ifdef _WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (!freq.QuadPart)
+    QueryPerformanceFrequency( &freq );
+  QueryPerformanceCounter( &now );
+  return (int64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+// Return the CPU time in nanoseconds of this thread, or the whole process.
+int64_t cpu_clock( BOOL process )
+{
+#ifdef _WIN32
+  FILETIME c, e, k, u;
+
+  if (process)
+    GetProcessTimes( GetCurrentProcess(), &c, &e, &k, &u );
+  else
+    GetThreadTimes( GetCurrentThread(), &c, &e, &k, &u );
+  return ((((int64_t)k.dwHighDateTime << 32) | k.dwLowDateTime) +
+	  (((int64_t)u.dwHighDateTime << 32) | u.dwLowDateTime)) * 100;
+#else
+  struct timespec ts;
+
+  clock_gettime( process ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID,
+		 &ts );
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+void start_phase( stamp* t )
+{
+  t->wall = wall_clock();
+  t->cpu = cpu_clock( FALSE );
+}
+
+
+void end_phase( stats* st, int phase, stamp* t )
+{
+  st->wall[phase] += wall_clock() - t->wall;
+  st->cpu[phase] += cpu_clock( FALSE ) - t->cpu;
+}
+
+
+// Load the hive NAME, replaying its logs unless "--raw", setting TOOK to the
+// time it took.
+BOOL open_hive( const char* name, regf_hive* h, stamp* took )
+{
+  BOOL ok;
+
+  start_phase( took );
+  ok = regf_load( name, h, !raw_hive );
+  took->wall = wall_clock() - took->wall;
+  took->cpu = cpu_clock( FALSE ) - took->cpu;
+  return ok;
+}
+
+
+// Add the stats of a thread to the total.
+void add_stats( stats* to, stats* from )
+{
+  int i;
+
+  to->keys += from->keys;
+  to->values += from->values;
+  to->chunks += from->chunks;
+  to->bytes_read += from->bytes_read;
+  to->bytes_written += from->bytes_written;
+  if (from->largest > to->largest)
+    to->largest = from->largest;
+  if (from->deepest > to->deepest)
+  {
+    free( to->deepest_path );
+    to->deepest = from->deepest;
+    to->deepest_path = from->deepest_path;
+    to->deepest_len = from->deepest_len;
+  }
+  else
+    free( from->deepest_path );
+  from->deepest_path = NULL;
+  for (i = 0; i < PHASES; ++i)
+  {
+    to->wall[i] += from->wall[i];
+    to->cpu[i] += from->cpu[i];
+  }
+}
+
+
+void print_stats( stats* st, int64_t wall, int64_t cpu )
+{
+  static const char* const phase[PHASES] = { "load", "walk", "format", "flush" };
+  int64_t fmt_cpu;
+  int	i;
+
+  // Formatting is within the walk.
+  fmt_cpu = (st->wall[PHASE_WALK] > 0)
+	    ? (int64_t)((double)st->cpu[PHASE_WALK] * st->wall[PHASE_FORMAT]
+			/ st->wall[PHASE_WALK])
+	    : 0;
+  st->cpu[PHASE_FORMAT] = fmt_cpu;
+  st->wall[PHASE_WALK] -= st->wall[PHASE_FORMAT];
+  st->cpu[PHASE_WALK] -= fmt_cpu;
+
+  fprintf( stderr, "keys:          %" PRId64 "\n", (int64_t)st->keys );
+  fprintf( stderr, "values:        %" PRId64 "\n", (int64_t)st->values );
+  fprintf( stderr, "db segments:   %" PRId64 "\n", (int64_t)st->chunks );
+  fprintf( stderr, "bytes read:    %" PRId64 "\n", (int64_t)st->bytes_read );
+  fprintf( stderr, "bytes written: %" PRId64 "\n", (int64_t)st->bytes_written );
+  fprintf( stderr, "largest value: %d\n", st->largest );
+  fprintf( stderr, "deepest key:   %d %.*s\n", st->deepest,
+	   (int)st->deepest_len, st->deepest_path ? st->deepest_path : "" );
+  fprintf( stderr, "\nphase      wall (s)   cpu (s)\n" );
+  for (i = 0; i < PHASES; ++i)
+    fprintf( stderr, "%-8s %10.3f %9.3f\n", phase[i],
+	     st->wall[i] / 1e9, st->cpu[i] / 1e9 );
+  fprintf( stderr, "%-8s %10.3f %9.3f\n", "total", wall / 1e9, cpu / 1e9 );
+}
+
+
+// Output is collected in a buffer and written a block at a time, rather than
+// going through stdio for every character.
+#define OUT_BLOCK 0x10000
+
+typedef struct
+{
+  char*  buf;
+  size_t len, size;
+  FILE*  file;			// where to flush, or NULL to keep everything
+} output;
+
+
+static const char hex_digit[] = "0123456789ABCDEF";
+
+// The two digits of every byte, so each one is a single copy.
+#define HEX_ROW( h ) h"0" h"1" h"2" h"3" h"4" h"5" h"6" h"7" \
+		     h"8" h"9" h"A" h"B" h"C" h"D" h"E" h"F"
+static const char hex_pair[] =
+  HEX_ROW( "0" ) HEX_ROW( "1" ) HEX_ROW( "2" ) HEX_ROW( "3" )
+  HEX_ROW( "4" ) HEX_ROW( "5" ) HEX_ROW( "6" ) HEX_ROW( "7" )
+  HEX_ROW( "8" ) HEX_ROW( "9" ) HEX_ROW( "A" ) HEX_ROW( "B" )
+  HEX_ROW( "C" ) HEX_ROW( "D" ) HEX_ROW( "E" ) HEX_ROW( "F" );
+
+
+// Compressed output ("-z") is done by a thread of its own, so the walk goes
+// on while the previous blocks are compressed and written.  Full buffers are
+// handed over through a small queue, coming back empty to be filled again.
+#define WRITE_QUEUE 8
+
+typedef struct
+{
+  char*  buf;
+  size_t len, size;
+} block;
+
+typedef struct
+{
+  FILE*    file;
+  block    queue[WRITE_QUEUE];	// full blocks, waiting to be compressed
+  int	   head, count;
+  block    spare[WRITE_QUEUE];	// empty blocks, ready to be filled
+  int	   spares;
+  BOOL	   done;		// nothing more will be queued
+  mutex_t  lock;
+  cond_t   ready;		// a block has been queued (or done)
+  cond_t   room;		// a block has been compressed
+  thread_t thread;
+  BOOL	   failed;		// compressing or writing, so the rest is dropped
+  char*    zbuf;		// the compressed data
+  size_t   zsize;
+#ifdef HAVE_ZLIB
+  z_stream gz;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx* zs;
+#endif
+} writer;
+
+writer zout;
+
+
+// Compress N bytes of S, writing what comes out; END finishes the stream.
+// Returns FALSE if it couldn't be compressed or written.
+BOOL compress_block( writer* z, const char* s, size_t n, BOOL end )
+{
+#ifdef HAVE_ZLIB
+  if (compression == COMPRESS_GZIP)
+  {
+    size_t len;
+    int    rc;
+
+    z->gz.next_in = (Bytef*)s;
+    z->gz.avail_in = (uInt)n;
+    do
+    {
+      z->gz.next_out = (Bytef*)z->zbuf;
+      z->gz.avail_out = (uInt)z->zsize;
+      // Z_BUF_ERROR just means there was nothing to do.
+      rc = deflate( &z->gz, end ? Z_FINISH : Z_NO_FLUSH );
+      if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+	return FALSE;
+      len = z->zsize - z->gz.avail_out;
+      if (fwrite( z->zbuf, 1, len, z->file ) != len)
+	return FALSE;
+    } while (z->gz.avail_out == 0);
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (compression == COMPRESS_ZSTD)
+  {
+    ZSTD_inBuffer  in = { s, n, 0 };
+    ZSTD_outBuffer out;
+    size_t left;
+
+    do
+    {
+      out.dst = z->zbuf;
+      out.size = z->zsize;
+      out.pos = 0;
+      left = ZSTD_compressStream2( z->zs, &out, &in,
+				   end ? ZSTD_e_end : ZSTD_e_continue );
+      if (ZSTD_isError( left ) ||
+	  fwrite( z->zbuf, 1, out.pos, z->file ) != out.pos)
+	return FALSE;
+    } while (end ? left != 0 : in.pos < in.size);
+  }
+#endif
+#if !defined(HAVE_ZLIB) && !defined(HAVE_ZSTD)
+  (void)z; (void)s; (void)n; (void)end;
+#endif
+  return TRUE;
+}
+
+
+THREAD_FUNC write_thread( void* arg )
+{
+  writer* z = arg;
+  block b;
+
+  mutex_lock( &z->lock );
+  for (;;)
+  {
+    while (z->count == 0 && !z->done)
+      cond_wait( &z->ready, &z->lock );
+    if (z->count == 0)
+      break;
+    b = z->queue[z->head];
+    mutex_unlock( &z->lock );
+
+    // Once it fails, the blocks are still taken, so the walk isn't held up.
+    if (!z->failed && !compress_block( z, b.buf, b.len, FALSE ))
+      z->failed = TRUE;
+
+    mutex_lock( &z->lock );
+    z->head = (z->head + 1) % WRITE_QUEUE;
+    --z->count;
+    if (z->spares < WRITE_QUEUE)
+      z->spare[z->spares++] = b;
+    else
+      free( b.buf );
+    cond_broadcast( &z->room );
+  }
+  mutex_unlock( &z->lock );
+
+  if (!z->failed && !compress_block( z, NULL, 0, TRUE ))
+    z->failed = TRUE;
+  if (!z->failed && fflush( z->file ) != 0)
+    z->failed = TRUE;
+  return 0;
+}
+
+
+// Set LO and HI to the levels the chosen method can be given.
+void level_range( int* lo, int* hi )
+{
+#ifdef HAVE_ZSTD
+  if (compression == COMPRESS_ZSTD)
+  {
+    // Negative levels are zstd's fast ones.
+    *lo = ZSTD_minCLevel();
+    *hi = ZSTD_maxCLevel();
+    return;
+  }
+#endif
+  *lo = 0;
+  *hi = 9;
+}
+
+
+BOOL start_writer( writer* z, FILE* file )
+{
+  memset( z, 0, sizeof(*z) );
+  z->file = file;
+  z->zsize = OUT_BLOCK;
+  z->zbuf = xrealloc( NULL, z->zsize );
+#ifdef _WIN32
+  _setmode( _fileno( file ), _O_BINARY );
+#endif
+#ifdef HAVE_ZLIB
+  // Adding 16 to the window bits writes a gzip header, rather than zlib's.
+  if (compression == COMPRESS_GZIP
+      && deflateInit2( &z->gz, (have_level) ? compress_level
+					      : Z_DEFAULT_COMPRESSION,
+		       Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK)
+    return FALSE;
+#endif
+#ifdef HAVE_ZSTD
+  if (compression == COMPRESS_ZSTD)
+  {
+    if ((z->zs = ZSTD_createCCtx()) == NULL)
+      return FALSE;
+    if (have_level && ZSTD_isError( ZSTD_CCtx_setParameter( z->zs,
+				      ZSTD_c_compressionLevel, compress_level ) ))
+      return FALSE;
+  }
+#endif
+  mutex_init( &z->lock );
+  cond_init( &z->ready );
+  cond_init( &z->room );
+  return thread_create( &z->thread, write_thread, z );
+}
+
+
+// Wait for everything queued to be written, finishing the stream.  Returns
+// FALSE if any of it couldn't be.
+BOOL stop_writer( writer* z )
+{
+  mutex_lock( &z->lock );
+  z->done = TRUE;
+  cond_broadcast( &z->ready );
+  mutex_unlock( &z->lock );
+  thread_join( z->thread );
+
+  while (z->spares)
+    free( z->spare[--z->spares].buf );
+  free( z->zbuf );
+#ifdef HAVE_ZLIB
+  if (compression == COMPRESS_GZIP)
+    deflateEnd( &z->gz );
+#endif
+#ifdef HAVE_ZSTD
+  if (compression == COMPRESS_ZSTD)
+    ZSTD_freeCCtx( z->zs );
+#endif
+  mutex_destroy( &z->lock );
+  cond_destroy( &z->ready );
+  cond_destroy( &z->room );
+  return !z->failed;
+}
+
+
+// Queue the buffer of O to be compressed, replacing it with an empty one.
+void give_block( output* o )
+{
+  writer* z = &zout;
+  block* b;
+
+  mutex_lock( &z->lock );
+  while (z->count == WRITE_QUEUE)
+    cond_wait( &z->room, &z->lock );
+  b = &z->queue[(z->head + z->count++) % WRITE_QUEUE];
+  b->buf = o->buf;
+  b->len = o->len;
+  b->size = o->size;
+  if (z->spares)
+  {
+    b = &z->spare[--z->spares];
+    o->buf = b->buf;
+    o->size = b->size;
+  }
+  else
+  {
+    o->buf = NULL;
+    o->size = 0;
+  }
+  cond_broadcast( &z->ready );
+  mutex_unlock( &z->lock );
+}
+
+
+// Write to the file, counting it as flushing.  A failure is kept for
+// out_close, as the writer does when compressing.
+void out_file( output* o, const char* s, size_t n )
+{
+  stamp t;
+
+  if (!show_stats)
+  {
+    if (fwrite( s, 1, n, o->file ) != n)
+      zout.failed = TRUE;
+    return;
+  }
+  start_phase( &t );
+  if (fwrite( s, 1, n, o->file ) != n)
+    zout.failed = TRUE;
+  totals.bytes_written += n;
+  end_phase( &totals, PHASE_FLUSH, &t );
+}
+
+
+void out_flush( output* o )
+{
+  stamp t;
+
+  if (o->len && o->file)
+  {
+    if (!compression)
+      out_file( o, o->buf, o->len );
+    else if (!show_stats)
+      give_block( o );
+    else
+    {
+      // Flushing is then the time spent waiting for room in the queue.
+      start_phase( &t );
+      totals.bytes_written += o->len;
+      give_block( o );
+      end_phase( &totals, PHASE_FLUSH, &t );
+    }
+    o->len = 0;
+  }
+}
+
+
+// Flush the last of the output, finishing any compression.  Returns FALSE
+// (having said so) if the output couldn't all be written.
+BOOL out_close( output* o )
+{
+  out_flush( o );
+  if ((compression && !stop_writer( &zout )) || zout.failed)
+  {
+    fputs( (compression) ? "z: unable to compress or write the output.\n"
+			 : "unable to write the output.\n", stderr );
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+// Ensure there is room for N more characters, returning where they go.
+char* out_reserve( output* o, size_t n )
+{
+  if (o->len + n > o->size)
+  {
+    out_flush( o );
+    if (o->len + n > o->size)
+    {
+      do
+	o->size = (o->size) ? o->size * 2 : OUT_BLOCK;
+      while (o->len + n > o->size);
+      o->buf = xrealloc( o->buf, o->size );
+    }
+  }
+  return o->buf + o->len;
+}
+
+
+void out_char( output* o, char c )
+{
+  if (o->len == o->size)
+    out_reserve( o, 1 );
+  o->buf[o->len++] = c;
+}
+
+
+void out_mem( output* o, const char* s, size_t n )
+{
+  memcpy( out_reserve( o, n ), s, n );
+  o->len += n;
+}
+
+
+// Write a block that may be large, bypassing the buffer if it is (unless it's
+// being compressed, when it's queued like the rest).
+void out_write( output* o, const char* s, size_t n )
+{
+  if (n < OUT_BLOCK || !o->file || compression)
+    out_mem( o, s, n );
+  else
+  {
+    out_flush( o );
+    out_file( o, s, n );
+  }
+}
+
+
+void out_str( output* o, const char* s )
+{
+  out_mem( o, s, strlen( s ) );
+}
+
+
+// Write an unsigned number, zero-padded to WIDTH digits.
+void out_uint( output* o, uint64_t v, int width )
+{
+  char	num[20];
+  char* p = num + 20;
+
+  do
+  {
+    *--p = '0' + (char)(v % 10);
+    v /= 10;
+  } while (v);
+  while (num + 20 - p < width)
+    *--p = '0';
+  out_mem( o, p, num + 20 - p );
+}
+
+
+void out_int( output* o, int64_t v )
+{
+  if (v < 0)
+  {
+    out_char( o, '-' );
+    out_uint( o, 0 - (uint64_t)v, 0 );
+  }
+  else
+    out_uint( o, v, 0 );
+}
+
+
+// Write an uppercase hexadecimal number, zero-padded to WIDTH digits.
+void out_hex( output* o, uint64_t v, int width )
+{
+  char	num[16];
+  char* p = num + 16;
+
+  do
+  {
+    *--p = hex_digit[v & 15];
+    v >>= 4;
+  } while (v);
+  while (num + 16 - p < width)
+    *--p = '0';
+  out_mem( o, p, num + 16 - p );
+}
+
+
+void out_byte( output* o, unsigned char b )
+{
+  memcpy( out_reserve( o, 2 ), hex_pair + 2 * b, 2 );
+  o->len += 2;
+}
+
+
+// Write a character as "<XX>" or "<XXXX>".
+char* put_escape( char* out, unsigned c )
+{
+  *out++ = '<';
+  if (c >= 0x100)
+  {
+    memcpy( out, hex_pair + 2 * ((c >> 8) & 255), 2 );
+    out += 2;
+  }
+  memcpy( out, hex_pair + 2 * (c & 255), 2 );
+  out[2] = '>';
+  return out + 3;
+}
+
+
+void out_escape( output* o, unsigned c )
+{
+  char* p = out_reserve( o, 6 );
+  o->len += put_escape( p, c ) - p;
+}
+
+
+// Write the leading printable characters of S, returning how many.
+size_t out_ascii( output* o, const unsigned char* s, size_t n )
+{
+  size_t done = 0, len, k;
+
+  while (done < n)
+  {
+    len = (n - done < OUT_BLOCK) ? n - done : OUT_BLOCK;
+    k = ascii_span( s + done, len );
+    out_mem( o, (const char*)s + done, k );
+    done += k;
+    if (k < len)
+      break;
+  }
+  return done;
+}
+
+
+size_t out_ascii16( output* o, const unsigned short* s, size_t n )
+{
+  size_t done = 0, len, k;
+
+  while (done < n)
+  {
+    len = (n - done < OUT_BLOCK) ? n - done : OUT_BLOCK;
+    k = narrow_span( out_reserve( o, len ), s + done, len );
+    o->len += k;
+    done += k;
+    if (k < len)
+      break;
+  }
+  return done;
+}
+
+
+// Names are UTF-8 in the machine-readable formats.
+char* make_name( char* out, char* in, int len, int comp )
+{
+  size_t n, k;
+
+  if (format != FMT_TEXT)
+    return regf_utf8( out, in, len, comp );
+
+  if (comp)
+  {
+    unsigned char* uc = (unsigned char*)in;
+    for (n = len; n > 0; --n)
+    {
+      k = ascii_span( uc, n );
+      memcpy( out, uc, k );
+      out += k;
+      uc += k;
+      n -= k;
+      if (n == 0)
+	break;
+      out = put_escape( out, *uc++ );
+    }
+  }
+  else
+  {
+    unsigned short* us = (unsigned short*)in;
+    for (n = len / 2; n > 0; --n)
+    {
+      k = narrow_span( out, us, n );
+      out += k;
+      us += k;
+      n -= k;
+      if (n == 0)
+	break;
+      out = put_escape( out, *us++ );
+    }
+  }
+  *out = '\0';
+  return out;
+}
+
+
+// The same names turn up all through a hive ("@", "DisplayName",
+// "ThreadingModel"...), so a walker keeps the renderings of those it has seen
+// in a hash of the raw name, needing only a copy the next time.  Long names
+// are rarely repeated and are always made.  The table starts over once it is
+// three-quarters full.
+#define NAME_SLOTS 0x1000	// must be a power of two
+#define NAME_RAW   128		// longest name kept
+
+typedef struct
+{
+  uint32_t hash;
+  uint32_t raw;		// offset of the name in the arena, then its text
+  unsigned short len, text_len; // zero len for an unused slot
+  BOOL	   comp;
+} name_entry;
+
+typedef struct
+{
+  name_entry* slot;
+  unsigned count;
+  char*    arena;
+  size_t   arena_len, arena_size;
+} name_cache;
+
+
+uint32_t name_hash( const char* in, int len, int comp )
+{
+  uint64_t h = (uint64_t)len << 1 | (comp != 0), v;
+  int	   i;
+
+  for (i = 0; i < len; i += 8)
+  {
+    v = 0;
+    memcpy( &v, in + i, (len - i < 8) ? len - i : 8 );
+    h = (h ^ v) * 0x9E3779B97F4A7C15ULL;
+  }
+  return (uint32_t)(h >> 32);
+}
+
+
+// Render a name like make_name, copying it if it has been seen before.
+char* cached_name( name_cache* c, char* out, char* in, int len, int comp )
+{
+  name_entry* e;
+  uint32_t h;
+  unsigned i;
+  char*    end;
+
+  if (len == 0 || len > NAME_RAW)
+    return make_name( out, in, len, comp );
+
+  if (!c->slot)
+  {
+    c->slot = xrealloc( NULL, NAME_SLOTS * sizeof(name_entry) );
+    memset( c->slot, 0, NAME_SLOTS * sizeof(name_entry) );
+  }
+  h = name_hash( in, len, comp );
+  comp = (comp != 0);
+  for (i = h;; ++i)
+  {
+    e = &c->slot[i & (NAME_SLOTS - 1)];
+    if (e->len == 0)
+      break;
+    if (e->hash == h && e->len == len && e->comp == comp &&
+	memcmp( c->arena + e->raw, in, len ) == 0)
+    {
+      memcpy( out, c->arena + e->raw + len, e->text_len );
+      out[e->text_len] = '\0';
+      return out + e->text_len;
+    }
+  }
+
+  end = make_name( out, in, len, comp );
+  if (c->count == NAME_SLOTS / 4 * 3)
+  {
+    c->count = 0;
+    c->arena_len = 0;
+    memset( c->slot, 0, NAME_SLOTS * sizeof(name_entry) );
+    e = &c->slot[h & (NAME_SLOTS - 1)];
+  }
+  if (c->arena_len + len + (end - out) > c->arena_size)
+  {
+    c->arena_size = (c->arena_size) ? c->arena_size * 2 : 0x10000;
+    c->arena = xrealloc( c->arena, c->arena_size );
+  }
+  e->hash = h;
+  e->raw = (uint32_t)c->arena_len;
+  e->len = (unsigned short)len;
+  e->text_len = (unsigned short)(end - out);
+  e->comp = comp;
+  memcpy( c->arena + c->arena_len, in, len );
+  memcpy( c->arena + c->arena_len + len, out, e->text_len );
+  c->arena_len += len + e->text_len;
+  ++c->count;
+  return end;
+}
+
+
+void free_names( name_cache* c )
+{
+  free( c->slot );
+  free( c->arena );
+}
+
+
+// Write two decimal digits.
+char* put_two( char* out, unsigned v )
+{
+  out[0] = '0' + v / 10;
+  out[1] = '0' + v % 10;
+  return out + 2;
+}
+
+
+// Times are formatted once per second and converted once per day: the values
+// of a key all share its time, and most of a hive is written on a few days.
+typedef struct
+{
+  int64_t secs;			// seconds from 1601 of the text
+  char	  text[32];		// "YYYY-MM-DD HH:MM:SS"
+  int	  len;			// 0 if nothing is cached
+  int64_t day;			// seconds from 1601 of local midnight
+  BOOL	  day_valid;		// the day has no change of offset
+} time_cache;
+
+
+// Convert seconds from 1601 to the local year, month, day, hour, minute and
+// second.  Both versions are safe when walks are on several threads.
+void local_time( int64_t secs, int* f )
+{
+#ifdef _WIN32
+  SYSTEMTIME st;
+  int64_t t = secs * 10000000;
+
+  FileTimeToSystemTime( (FILETIME*)&t, &st );
+  SystemTimeToTzSpecificLocalTime( NULL, &st, &st );
+  f[0] = st.wYear; f[1] = st.wMonth;  f[2] = st.wDay;
+  f[3] = st.wHour; f[4] = st.wMinute; f[5] = st.wSecond;
+#else
+  // Translate seconds from 1601 to seconds from 1970.
+  time_t t = (time_t)secs - 11644473600;
+  struct tm lt;
+
+  localtime_r( &t, &lt );
+  f[0] = lt.tm_year+1900; f[1] = lt.tm_mon+1; f[2] = lt.tm_mday;
+  f[3] = lt.tm_hour;	  f[4] = lt.tm_min;   f[5] = lt.tm_sec;
+#endif
+}
+
+
+void format_time( time_cache* c, int64_t secs )
+{
+  int	f[6], g[6], rest;
+  char* p;
+
+  if (c->day_valid && secs >= c->day && secs < c->day + 86400)
+  {
+    // Same day, so keep the date and work out the time.
+    rest = (int)(secs - c->day);
+    f[3] = rest / 3600;
+    f[4] = rest / 60 % 60;
+    f[5] = rest % 60;
+    p = c->text + c->len - 8;
+  }
+  else
+  {
+    local_time( secs, f );
+    p = c->text + sprintf( c->text, "%d-", f[0] );
+    p = put_two( p, f[1] ); *p++ = '-';
+    p = put_two( p, f[2] ); *p++ = ' ';
+
+    // The time can only be derived from midnight if the offset stays the
+    // same all day (i.e. it's not a daylight saving change), so make sure
+    // the day really does run from midnight to midnight.
+    c->day = secs - (f[3] * 3600 + f[4] * 60 + f[5]);
+    local_time( c->day, g );
+    c->day_valid = (g[0] == f[0] && g[1] == f[1] && g[2] == f[2] &&
+		    g[3] == 0 && g[4] == 0 && g[5] == 0);
+    if (c->day_valid)
+    {
+      local_time( c->day + 86399, g );
+      c->day_valid = (g[0] == f[0] && g[1] == f[1] && g[2] == f[2] &&
+		      g[3] == 23 && g[4] == 59 && g[5] == 59);
+    }
+  }
+  p = put_two( p, f[3] ); *p++ = ':';
+  p = put_two( p, f[4] ); *p++ = ':';
+  p = put_two( p, f[5] );
+  c->len = (int)(p - c->text);
+  c->secs = secs;
+}
+
+
+void print_time( output* o, time_cache* c, int64_t t, BOOL full, BOOL brackets )
+{
+  int64_t secs = t / 10000000;
+
+  if (brackets)
+    out_char( o, '[' );
+
+  if (c->len == 0 || secs != c->secs)
+    format_time( c, secs );
+  out_mem( o, c->text, c->len );
+  if (full)
+  {
+    int frac = (int)(t % 10000000);
+    out_char( o, '.' );
+    if (frac < 0)
+    {
+      out_char( o, '-' );
+      out_uint( o, -frac, 6 );
+    }
+    else
+      out_uint( o, frac, 7 );
+  }
+
+  if (brackets)
+  {
+    out_char( o, ']' );
+    out_char( o, ' ' );
+  }
+}
+
+
+// Parse TIME as a local "YYYY-MM-DD[ HH:MM[:SS]]" or as a FILETIME, returning
+// 0 if it's neither.
+int64_t parse_time( const char* time )
+{
+  int	f[6] = { 0, 0, 0, 0, 0, 0 };
+  char	c;
+#ifdef _WIN32
+  SYSTEMTIME st, utc;
+  FILETIME ft;
+#else
+  struct tm lt;
+  time_t t;
+#endif
+
+  if (sscanf( time, "%d-%d-%d %d:%d:%d", f, f+1, f+2, f+3, f+4, f+5 ) < 3)
+  {
+    int64_t ft = 0;
+    for (; *time >= '0' && *time <= '9'; ++time)
+      ft = ft * 10 + (*time - '0');
+    return (*time == '\0') ? ft : 0;
+  }
+  if (sscanf( time, "%*d-%*d-%*d%c", &c ) == 1 && c != ' ')
+    return 0;
+
+#ifdef _WIN32
+  memset( &st, 0, sizeof(st) );
+  st.wYear = f[0]; st.wMonth  = f[1]; st.wDay    = f[2];
+  st.wHour = f[3]; st.wMinute = f[4]; st.wSecond = f[5];
+  if (!TzSpecificLocalTimeToSystemTime( NULL, &st, &utc ) ||
+      !SystemTimeToFileTime( &utc, &ft ))
+    return 0;
+  return ((int64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+#else
+  memset( &lt, 0, sizeof(lt) );
+  lt.tm_year = f[0] - 1900; lt.tm_mon = f[1] - 1; lt.tm_mday = f[2];
+  lt.tm_hour = f[3];	    lt.tm_min = f[4];	  lt.tm_sec  = f[5];
+  lt.tm_isdst = -1;
+  t = mktime( &lt );
+  if (t == (time_t)-1)
+    return 0;
+  return ((int64_t)t + 11644473600) * 10000000;
+#endif
+}
+
+
+// What's kept of each key being walked, beside the walk's own stack.
+typedef struct
+{
+  size_t path;			// end of its path
+  BOOL*  leave_key;
+  BOOL	 empty_key;
+} frame;
+
+
+// An index of the key paths (as they would be printed), sorted ignoring case,
+// kept beside the hive to find keys without searching for them.
+#define INDEX_VERSION 1
+
+typedef struct
+{
+  char signature[4];		// "rdix"
+  int  version;
+  int  sequence;		// primary_sequence_number of the hive
+  int  timestamp[2];		// last_written_timestamp of the hive
+  int  utf8;			// names are for the machine-readable formats
+  int  count;			// number of entries
+  int  names_size;		// size of the paths following the entries
+} index_header;
+
+typedef struct
+{
+  int	   offset;		// of the key's cell
+  int	   flags;		// the special keys it is under
+  unsigned path, len;		// its path in the names
+} index_entry;
+
+#define UNDER_PROPERTIES     1
+#define UNDER_DRIVERPACKAGES 2
+
+typedef struct
+{
+  index_entry* entry;
+  int	 count, size;
+  output names;			// the paths, one after the other
+  char*  file;			// the index as read, or NULL when built
+} key_index;
+
+
+// State of a walk through a hive; each thread has its own.
+typedef struct walker
+{
+  output* out;
+  regf_bins bins;
+  char*   full;			// the path being printed
+  size_t  full_size;
+  size_t  base;			// end of the path above the walk
+  int	  base_depth;		// and its number of keys, for "--stats"
+  regf_walker rw;
+  frame*  stack;		// for each key of the walk's stack
+  int	  stack_size;
+  BOOL	  properties, driverpackages;
+  BOOL	  shallow;		// don't walk the subkeys
+  BOOL	  group;		// values follow a line of their key
+  int64_t since;		// only print keys written after this (or 0 for all)
+  time_cache times;
+  key_index* index;		// being built, instead of printing
+  const char* prefix;		// start of each line
+  stats*  stats;		// for "--stats", or NULL
+  name_cache names;
+  // Writes a value's line up to its data (see value_heads).
+  void	(*head)( struct walker* w, regf_key_block* key, regf_value_block* val,
+		 size_t path, size_t end );
+} walker;
+
+
+// Ensure the path can hold N more characters after END.
+void path_reserve( walker* w, size_t end, size_t n )
+{
+  if (end + n > w->full_size)
+  {
+    do
+      w->full_size = (w->full_size) ? w->full_size * 2 : 0x1000;
+    while (end + n > w->full_size);
+    w->full = xrealloc( w->full, w->full_size );
+  }
+}
+
+
+// Add "/NAME" to the path at END, returning the new end.  A byte can expand
+// to four characters ("<XX>") and a character to six ("<XXXX>").
+size_t add_name( walker* w, size_t end, char* name, int len, int comp )
+{
+  path_reserve( w, end, 2 + len * (size_t)(comp ? 4 : 3) );
+  w->full[end] = '/';
+  return cached_name( &w->names, w->full + end + 1, name, len, comp ) - w->full;
+}
+
+
+// Check for the keys that change how types are treated, returning the flag to
+// reset when leaving the key.
+BOOL* special_key( walker* w, regf_key_block* key )
+{
+  if (!w->properties)
+  {
+    if (key->len == 10 && memcmp( "Properties", key->name, key->len ) == 0)
+    {
+      w->properties = TRUE;
+      return &w->properties;
+    }
+  }
+  if (!w->driverpackages)
+  {
+    if (key->len == 14 && memcmp( "DriverPackages", key->name, key->len ) == 0)
+    {
+      w->driverpackages = TRUE;
+      return &w->driverpackages;
+    }
+  }
+  return NULL;
+}
+
+
+// Write N bytes of P as hexadecimal, with a comma between each (and before
+// the first, unless FIRST).  Each byte is written as "XX,", taking back the
+// last comma.
+void out_hexlist( output* o, const unsigned char* p, int n, BOOL first )
+{
+  char* q;
+  int	i, k;
+
+  for (; n > 0; p += k, n -= k, first = FALSE)
+  {
+    k = (n < OUT_BLOCK / 4) ? n : OUT_BLOCK / 4;
+    q = out_reserve( o, 1 + 3 * k );
+    if (!first)
+      *q++ = ',';
+    for (i = 0; i < k; ++i, q += 3)
+    {
+      memcpy( q, hex_pair + 2 * p[i], 2 );
+      q[2] = ',';
+    }
+    o->len = q - 1 - o->buf;
+  }
+}
+
+
+// See if binary data is text: 7 out of 8 bytes, or 3 out of 4 words.  Returns
+// the size of the characters, setting ALL if every byte is printable.
+int is_text( regf_value_data* vd, BOOL* all )
+{
+  unsigned char* uc = (unsigned char*)vd->data;
+  unsigned short* us = (unsigned short*)vd->data;
+  size_t need, count, left, k, want;
+  int	width, s, n, len;
+  char* p;
+
+  *all = FALSE;
+  if (uc[1] == 0 && uc[3] == 0)
+  {
+    if (!(*us >= 32 && *us < 127 && us[1] >= 32 && us[1] < 127))
+      return 0;
+    width = 16;
+    need = ((size_t)vd->size * 3 + 7) / 8;
+    left = vd->size / 2;
+  }
+  else if (*uc >= 32 && *uc < 127 && uc[1] >= 32 && uc[1] < 127)
+  {
+    width = 8;
+    need = ((size_t)vd->size * 7 + 7) / 8;
+    left = vd->size;
+  }
+  else
+    return 0;
+
+  // Each segment only has to make up what the rest could not.
+  count = 0;
+  n = regf_segment_count( vd );
+  for (s = 0; s < n; ++s)
+  {
+    p = regf_segment( vd, s, &len );
+    if (width == 16)
+      len /= 2;
+    left -= len;
+    want = (need > count + left) ? need - count - left : 0;
+    k = (width == 16) ? count_ascii16( (unsigned short*)p, len, want )
+		      : count_ascii( (unsigned char*)p, len, want );
+    if (k < want)
+      return 0;
+    count += k;
+  }
+  *all = (width == 8 && count == (size_t)vd->size);
+  return width;
+}
+
+
+// Strings are stored as Unicode (UTF-16LE).
+void print_string( output* out, regf_value_data* vd, int type, int bintext )
+{
+  unsigned short* us;
+  int	n, s, len = 0, size, base, i;
+  unsigned next;
+
+  n = regf_segment_count( vd );
+  size = vd->size / 2;
+  if (!bintext)
+  {
+    // Ignore trailing nulls, which may take up whole segments.
+    for (s = n; s-- > 0; )
+    {
+      us = (unsigned short*)regf_segment( vd, s, &len );
+      len /= 2;
+      while (len > 0 && us[len-1] == '\0')
+	--len;
+      if (len > 0)
+	break;
+    }
+    size = (s < 0) ? 0 : s * (REGF_DB_SEGMENT / 2) + len;
+  }
+
+  for (s = 0, base = 0; base < size; ++s, base += len)
+  {
+    us = (unsigned short*)regf_segment( vd, s, &len );
+    len /= 2;
+    if (len > size - base)
+      len = size - base;
+    for (i = 0; i < len; ++i)
+    {
+      i += (int)out_ascii16( out, us + i, len - i );
+      if (i == len)
+	break;
+      if (us[i] == '\0' && type == REG_MULTI_SZ && base+i+1 < size)
+      {
+	if (i+1 < len)
+	  next = us[i+1];
+	else
+	{
+	  int dummy;
+	  next = *(unsigned short*)regf_segment( vd, s+1, &dummy );
+	}
+	if (next != '\0')
+	{
+	  out_mem( out, "<>", 2 );
+	  continue;
+	}
+      }
+      if (us[i] == '\0' && !all_string && !bintext)
+      {
+	out_mem( out, " <...>", 6 );
+	return;
+      }
+      out_escape( out, us[i] );
+    }
+  }
+}
+
+
+void print_text( output* out, regf_value_data* vd, BOOL all )
+{
+  unsigned char* uc;
+  int	n, s, len, i;
+
+  n = regf_segment_count( vd );
+  for (s = 0; s < n; ++s)
+  {
+    uc = (unsigned char*)regf_segment( vd, s, &len );
+    // The count shows if it's all printable, which needs no escaping at all.
+    if (all)
+    {
+      out_write( out, (char*)uc, len );
+      continue;
+    }
+    for (i = 0; i < len; ++i)
+    {
+      i += (int)out_ascii( out, uc + i, len - i );
+      if (i == len)
+	break;
+      out_escape( out, uc[i] );
+    }
+  }
+}
+
+
+void print_hex( output* out, regf_value_data* vd )
+{
+  unsigned char* uc;
+  int	n, s, len;
+
+  n = regf_segment_count( vd );
+  for (s = 0; s < n; ++s)
+  {
+    uc = (unsigned char*)regf_segment( vd, s, &len );
+    out_hexlist( out, uc, len, s == 0 );
+  }
+}
+
+
+// Write a JSON string, escaping quotes, backslashes and control characters.
+void out_json( output* o, const char* s, size_t n )
+{
+  unsigned char c;
+  char* p;
+  size_t i;
+
+  out_char( o, '"' );
+  for (i = 0; i < n; ++i)
+  {
+    c = (unsigned char)s[i];
+    if (c == '"' || c == '\\')
+    {
+      p = out_reserve( o, 2 );
+      p[0] = '\\';
+      p[1] = c;
+      o->len += 2;
+    }
+    else if (c < 32)
+    {
+      p = out_reserve( o, 6 );
+      memcpy( p, "\\u00", 4 );
+      p[4] = hex_digit[c >> 4];
+      p[5] = hex_digit[c & 15];
+      o->len += 6;
+    }
+    else
+      out_char( o, c );
+  }
+  out_char( o, '"' );
+}
+
+
+static const char base64_digit[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Write data as base64.  Segments are a multiple of three bytes, so each can
+// be written by itself.
+void out_base64( output* o, const unsigned char* s, size_t n )
+{
+  size_t i, k;
+  unsigned v;
+  char* p;
+
+  for (; n > 0; s += k, n -= k)
+  {
+    k = (n < 3 * 4096) ? n : 3 * 4096;
+    p = out_reserve( o, (k + 2) / 3 * 4 );
+    for (i = 0; i + 3 <= k; i += 3, p += 4)
+    {
+      v = (s[i] << 16) | (s[i+1] << 8) | s[i+2];
+      p[0] = base64_digit[v >> 18];
+      p[1] = base64_digit[(v >> 12) & 63];
+      p[2] = base64_digit[(v >> 6) & 63];
+      p[3] = base64_digit[v & 63];
+    }
+    if (i < k)
+    {
+      v = (s[i] << 16) | ((i + 1 < k) ? s[i+1] << 8 : 0);
+      p[0] = base64_digit[v >> 18];
+      p[1] = base64_digit[(v >> 12) & 63];
+      p[2] = (i + 1 < k) ? base64_digit[(v >> 6) & 63] : '=';
+      p[3] = '=';
+      p += 4;
+    }
+    o->len = p - o->buf;
+  }
+}
+
+
+// Numbers in the binary format are little-endian, like the hive.
+void out_u32( output* o, unsigned v )
+{
+  out_mem( o, (char*)&v, 4 );
+}
+
+
+void out_u64( output* o, uint64_t v )
+{
+  out_mem( o, (char*)&v, 8 );
+}
+
+
+// Write the record of a hive in the machine-readable formats.
+void print_hive( output* o, const char* name )
+{
+  size_t len = strlen( name );
+
+  if (format == FMT_NDJSON)
+  {
+    out_mem( o, "{\"hive\":", 8 );
+    out_json( o, name, len );
+    out_mem( o, "}\n", 2 );
+  }
+  else
+  {
+    out_char( o, 'H' );
+    out_u32( o, (unsigned)len );
+    out_mem( o, name, len );
+  }
+}
+
+
+void print_key_record( walker* w, regf_key_block* key, size_t path )
+{
+  output* out = w->out;
+
+  if (format == FMT_NDJSON)
+  {
+    out_mem( out, "{\"key\":", 7 );
+    out_json( out, w->full, path );
+    out_mem( out, ",\"time\":", 8 );
+    out_int( out, key->timestamp );
+    if (show_security)
+    {
+      out_mem( out, ",\"sk\":", 6 );
+      out_uint( out, (unsigned)key->security, 0 );
+    }
+    out_mem( out, "}\n", 2 );
+  }
+  else
+  {
+    out_char( out, 'K' );
+    out_u64( out, key->timestamp );
+    out_u32( out, (unsigned)path );
+    out_mem( out, w->full, path );
+  }
+}
+
+
+// Write a value with its raw type and data; the name is between PATH and END.
+void print_record( walker* w, regf_key_block* key, regf_value_block* val,
+		   regf_value_data* vd, int more, size_t path, size_t end )
+{
+  output* out = w->out;
+  size_t name_len = (val->name_len == 0) ? 0 : end - path - 1;
+  int	n, s, len;
+  char* p;
+
+  if (format == FMT_NDJSON)
+  {
+    out_mem( out, "{\"key\":", 7 );
+    out_json( out, w->full, path );
+    out_mem( out, ",\"name\":", 8 );
+    out_json( out, w->full + path + 1, name_len );
+    out_mem( out, ",\"type\":", 8 );
+    out_uint( out, (unsigned)val->value_type, 0 );
+    out_mem( out, ",\"size\":", 8 );
+    out_int( out, vd->size + more );
+    out_mem( out, ",\"time\":", 8 );
+    out_int( out, key->timestamp );
+    if (more)
+    {
+      out_mem( out, ",\"more\":", 8 );
+      out_int( out, more );
+    }
+    out_mem( out, ",\"data\":\"", 9 );
+  }
+  else
+  {
+    out_char( out, 'V' );
+    out_u64( out, key->timestamp );
+    out_u32( out, (unsigned)val->value_type );
+    out_u32( out, (unsigned)path );
+    out_u32( out, (unsigned)name_len );
+    out_u32( out, (unsigned)vd->size );
+    out_mem( out, w->full, path );
+    out_mem( out, w->full + path + 1, name_len );
+  }
+
+  n = regf_segment_count( vd );
+  for (s = 0; s < n; ++s)
+  {
+    p = regf_segment( vd, s, &len );
+    if (format == FMT_NDJSON)
+      out_base64( out, (unsigned char*)p, len );
+    else
+      out_write( out, p, len );
+  }
+
+  if (format == FMT_NDJSON)
+    out_mem( out, "\"}\n", 3 );
+}
+
+
+// The start of a value's line, up to its data, is made for each combination
+// of the options that shape it; one is chosen for the walker, rather than
+// testing them all again for every value.
+#define VALUE_HEAD( PREFIX, TIME, GROUP, HEX )				      \
+void head_##PREFIX##TIME##GROUP##HEX( walker* w, regf_key_block* key,	      \
+				      regf_value_block* val,		      \
+				      size_t path, size_t end )		      \
+{									      \
+  output* out = w->out; 						      \
+  size_t name = 0;							      \
+									      \
+  if (PREFIX)								      \
+    out_str( out, w->prefix );						      \
+  /* With GROUP the key (and its time) has been written, so just the name. */ \
+  if (GROUP)								      \
+  {									      \
+    out_mem( out, "  ", 2 );						      \
+    name = path + 1;							      \
+  }									      \
+  else if (TIME) 							      \
+    print_time( out, &w->times, key->timestamp, time_full, TRUE );	      \
+  if (HEX)								      \
+  {									      \
+    out_char( out, '[' );						      \
+    out_hex( out, (unsigned)val->value_type, 8 );			      \
+    out_char( out, ':' );						      \
+    out_hex( out, val->size & 0x7fffffff, 8 );				      \
+    out_mem( out, "] ", 2 );						      \
+    out_mem( out, w->full + name, end - name ); 			      \
+    out_mem( out, " = ", 3 );						      \
+  }									      \
+  else									      \
+  {									      \
+    out_mem( out, w->full + name, end - name ); 			      \
+    out_mem( out, " [", 2 );						      \
+    out_int( out, val->value_type );					      \
+    out_char( out, ':' );						      \
+    out_int( out, val->size & 0x7fffffff );				      \
+    out_mem( out, "] = ", 4 );						      \
+  }									      \
+}
+
+#define VALUE_HEADS( PREFIX, TIME ) \
+  VALUE_HEAD( PREFIX, TIME, 0, 0 ) VALUE_HEAD( PREFIX, TIME, 0, 1 ) \
+  VALUE_HEAD( PREFIX, TIME, 1, 0 ) VALUE_HEAD( PREFIX, TIME, 1, 1 )
+
+VALUE_HEADS( 0, 0 )
+VALUE_HEADS( 0, 1 )
+VALUE_HEADS( 1, 0 )
+VALUE_HEADS( 1, 1 )
+
+static void (* const value_heads[16])( walker*, regf_key_block*,
+				       regf_value_block*, size_t, size_t ) =
+{
+  head_0000, head_0001, head_0010, head_0011,
+  head_0100, head_0101, head_0110, head_0111,
+  head_1000, head_1001, head_1010, head_1011,
+  head_1100, head_1101, head_1110, head_1111
+};
+
+
+// Choose the value line for W, once its options (and the globals) are set.
+void set_head( walker* w )
+{
+  w->head = value_heads[(w->prefix != NULL) << 3 |
+			(time_sec || time_full) << 2 |
+			(w->group != FALSE) << 1 | (hex_type != FALSE)];
+}
+
+
+// Print a value of KEY, whose path ends at PATH, with its data VD.  How it's
+// written is worked out from all of it, but only the first "--max-data" bytes
+// of a string, text or hex are written, so the segments of big data beyond
+// that are only read to see if binary data is text.
+void print_value( walker* w, regf_key_block* key, regf_value_block* val,
+		  regf_value_data* vd, size_t path )
+{
+  output* out = w->out;
+  int	size, type;
+  char* data;
+  size_t end;
+  int	bintext;
+  BOOL	all;
+  BOOL	string;
+  regf_value_data part;
+  int	more = 0;
+
+  if (val->name_len == 0)
+  {
+    path_reserve( w, path, 3 );
+    memcpy( w->full + path, "/@", 3 );
+    end = path + 2;
+  }
+  else
+    end = add_name( w, path, val->name, val->name_len,
+		    val->flags & REGF_VALUE_COMP_NAME );
+
+  data = vd->data;
+  if (w->stats)
+  {
+    if (vd->segs)
+      w->stats->chunks += regf_segment_count( vd );
+    if (vd->size > w->stats->largest)
+      w->stats->largest = vd->size;
+  }
+
+  if (format != FMT_TEXT)
+  {
+    if (max_data >= 0 && vd->size > max_data)
+    {
+      more = vd->size - max_data;
+      part = *vd;
+      part.size = max_data;
+      vd = &part;
+    }
+    print_record( w, key, val, vd, more, path, end );
+    return;
+  }
+
+  w->head( w, key, val, path, end );
+
+  size = vd->size;
+  type = val->value_type;
+  if (w->properties && (type & 0xFFFF0000) == 0xFFFF0000)
+  {
+    switch (type & 0xFFFF)
+    {
+      case DEVPROP_TYPE_INT32:
+      case DEVPROP_TYPE_UINT32:
+	type = REG_DWORD;
+	break;
+      case DEVPROP_TYPE_INT64:
+      case DEVPROP_TYPE_UINT64:
+      case DEVPROP_TYPE_FILETIME:
+	type = REG_QWORD;
+	break;
+      case DEVPROP_TYPE_STRING:
+      case DEVPROP_TYPE_STRING_INDIRECT:
+	type = REG_SZ;
+	break;
+      case DEVPROP_TYPE_STRING_LIST:
+	type = REG_MULTI_SZ;
+	break;
+    }
+  }
+  else if (w->driverpackages)
+    type &= 0xFFFF;
+
+  bintext = 0;
+  all = FALSE;
+  if ((type == REG_BINARY || type == REG_NONE) && size >= 8)
+    bintext = is_text( vd, &all );
+
+  if (type == REG_DWORD && size == 4)
+  {
+    out_mem( out, "0x", 2 );
+    out_hex( out, *(unsigned*)data, 0 );
+    out_mem( out, " (", 2 );
+    out_int( out, *(int*)data );
+    out_char( out, ')' );
+  }
+  else if (w->properties && size == 1 &&
+	   (type == (0xFFFF0000 | DEVPROP_TYPE_BOOLEAN)))
+  {
+    if (*data == -1)
+      out_mem( out, "true", 4 );
+    else if (*data == 0)
+      out_mem( out, "false", 5 );
+    else
+      out_byte( out, *(unsigned char*)data );
+  }
+  else if (w->properties && size == 2 &&
+	   (type == (0xFFFF0000 | DEVPROP_TYPE_UINT16) ||
+	    type == (0xFFFF0000 | DEVPROP_TYPE_INT16)))
+  {
+    out_mem( out, "0x", 2 );
+    out_hex( out, *(unsigned short*)data, 0 );
+    out_mem( out, " (", 2 );
+    if ((type & 0xFFFF) == DEVPROP_TYPE_UINT16)
+      out_int( out, *(unsigned short*)data );
+    else
+      out_int( out, *(short*)data );
+    out_char( out, ')' );
+  }
+  // See if 8 bytes is a 21st century FILETIME.
+  else if (size == 8 &&
+	   (type == REG_QWORD || type == REG_BINARY || type == REG_NONE) &&
+	   *(int64_t*)data >= (int64_t)126227808000000000 &&  // 2001-01-01
+	   *(int64_t*)data < (int64_t)157784544000000000)     // 2101-01-01
+  {
+    print_time( out, &w->times, *(int64_t*)data, FALSE, FALSE );
+    if (type == REG_QWORD)
+    {
+      out_mem( out, " (0x", 4 );
+      out_hex( out, *(uint64_t*)data, 0 );
+      out_mem( out, "; ", 2 );
+      out_int( out, *(int64_t*)data );
+      out_char( out, ')' );
+    }
+    else
+    {
+      out_mem( out, " (", 2 );
+      out_hexlist( out, (unsigned char*)data, size, TRUE );
+      out_char( out, ')' );
+    }
+  }
+  else if (type == REG_QWORD && size == 8)
+  {
+    out_mem( out, "0x", 2 );
+    out_hex( out, *(uint64_t*)data, 0 );
+    out_mem( out, " (", 2 );
+    out_int( out, *(int64_t*)data );
+    out_char( out, ')' );
+  }
+  else
+  {
+    string = (type == REG_SZ ||
+	      type == REG_MULTI_SZ ||
+	      type == REG_EXPAND_SZ ||
+	      type == REG_LINK ||
+	      bintext == 16);
+    if (max_data >= 0 && size > max_data)
+    {
+      part = *vd;
+      // Don't split a UTF-16 code unit.
+      part.size = (string) ? max_data & ~1 : max_data;
+      more = size - part.size;
+      vd = &part;
+    }
+    if (string)
+      print_string( out, vd, type, bintext );
+    else if (bintext /*== 8*/)
+      print_text( out, vd, all );
+    else
+      print_hex( out, vd );
+  }
+  if (more)
+  {
+    out_mem( out, " <+", 3 );
+    out_int( out, more );
+    out_mem( out, " more>", 6 );
+  }
+  out_char( out, '\n' );
+}
+
+
+// Print a value of KEY straight from its cell.
+void print_cell( walker* w, regf_key_block* key, regf_value_block* val,
+		 size_t path )
+{
+  regf_value_data vd;
+
+  regf_data( &w->bins, val, &vd );
+  print_value( w, key, val, &vd, path );
+}
+
+
+// Add KEY to the index being built, rather than printing it.
+void add_entry( walker* w, regf_key_block* key, size_t path )
+{
+  key_index* x = w->index;
+  index_entry* e;
+
+  if (x->count == x->size)
+  {
+    x->size = (x->size) ? x->size * 2 : 0x1000;
+    x->entry = xrealloc( x->entry, x->size * sizeof(index_entry) );
+  }
+  e = &x->entry[x->count++];
+  e->offset = (int)((char*)key - w->bins.root);
+  e->flags = (w->properties ? UNDER_PROPERTIES : 0)
+	   | (w->driverpackages ? UNDER_DRIVERPACKAGES : 0);
+  e->path = (unsigned)x->names.len;
+  e->len = (unsigned)path;
+  out_mem( &x->names, w->full, path );
+}
+
+
+// Security descriptors are written in SDDL, as Windows does, except that a SID
+// is only given a name if it's well known (not relative to a domain).
+static const char* const sid_names[][2] =
+{
+  { "S-1-1-0",	    "WD" }, { "S-1-3-0",      "CO" }, { "S-1-3-1",      "CG" },
+  { "S-1-5-2",	    "NU" }, { "S-1-5-4",      "IU" }, { "S-1-5-6",      "SU" },
+  { "S-1-5-7",	    "AN" }, { "S-1-5-9",      "ED" }, { "S-1-5-10",     "PS" },
+  { "S-1-5-11",     "AU" }, { "S-1-5-12",     "RC" }, { "S-1-5-18",     "SY" },
+  { "S-1-5-19",     "LS" }, { "S-1-5-20",     "NS" }, { "S-1-5-33",     "WR" },
+  { "S-1-5-32-544", "BA" }, { "S-1-5-32-545", "BU" }, { "S-1-5-32-546", "BG" },
+  { "S-1-5-32-547", "PU" }, { "S-1-5-32-548", "AO" }, { "S-1-5-32-549", "SO" },
+  { "S-1-5-32-550", "PO" }, { "S-1-5-32-551", "BO" }, { "S-1-5-32-552", "RE" },
+  { "S-1-5-32-554", "RU" }, { "S-1-5-32-555", "RD" }, { "S-1-5-32-556", "NO" },
+  { "S-1-5-32-558", "MU" }, { "S-1-5-32-559", "LU" }, { "S-1-5-32-568", "IS" },
+  { "S-1-5-32-569", "CY" }, { "S-1-5-32-573", "ER" }, { "S-1-5-32-578", "HA" },
+  { "S-1-5-32-579", "AA" }, { "S-1-5-32-580", "RM" }, { "S-1-15-2-1",   "AC" },
+  { "S-1-16-4096",  "LW" }, { "S-1-16-8192",  "ME" }, { "S-1-16-8448",  "MP" },
+  { "S-1-16-12288", "HI" }, { "S-1-16-16384", "SI" },
+  { "S-1-5-84-0-0-0-0-0", "UD" },
+};
+
+// Access rights: the key aliases are used for an exact match, otherwise the
+// mask must be made up of the rest (or it's written as a number).
+typedef struct
+{
+  unsigned mask;
+  const char* name;
+} right_name;
+
+static const right_name key_rights[] =
+{
+  { 0xF003F, "KA" }, { 0x20019, "KR" }, { 0x20006, "KW" }, { 0, NULL }
+};
+
+static const right_name rights[] =
+{
+  { 0x10000000, "GA" }, { 0x80000000, "GR" }, { 0x40000000, "GW" },
+  { 0x20000000, "GX" }, { 0x00020000, "RC" }, { 0x00010000, "SD" },
+  { 0x00040000, "WD" }, { 0x00080000, "WO" }, { 0x00000010, "RP" },
+  { 0x00000020, "WP" }, { 0x00000001, "CC" }, { 0x00000002, "DC" },
+  { 0x00000004, "LC" }, { 0x00000008, "SW" }, { 0x00000080, "LO" },
+  { 0x00000040, "DT" }, { 0x00000100, "CR" }, { 0, NULL }
+};
+
+static const right_name label_rights[] =
+{
+  { 1, "NW" }, { 2, "NR" }, { 4, "NX" }, { 0, NULL }
+};
+
+static const char* const ace_types[] =
+{
+  "A", "D", "AU", "AL", NULL, "OA", "OD", "OU", "OL", "XA", "XD", "ZA",
+  NULL, "XU", NULL, NULL, NULL, "ML", "RA", "SP"
+};
+
+// The object types have GUIDs before the SID.
+#define OBJECT_ACE( type ) (((type) >= 5 && (type) <= 8) || (type) == 11)
+
+static const char* const ace_flags[] =
+{
+  "OI", "CI", "NP", "IO", "ID", NULL, "SA", "FA"
+};
+
+
+unsigned get_u32( const unsigned char* p )
+{
+  unsigned v;
+
+  memcpy( &v, p, 4 );
+  return v;
+}
+
+
+// Write the SID of up to LEN bytes at P, returning its size, or zero if it's
+// not all there.
+size_t out_sid( output* o, const unsigned char* p, size_t len )
+{
+  char	   sid[200];
+  char*    s;
+  uint64_t auth;
+  int	   i;
+
+  if (len < 8 || p[0] != 1 || p[1] > 15 || len < 8 + 4 * (size_t)p[1])
+    return 0;
+  for (auth = 0, i = 2; i < 8; ++i)
+    auth = auth << 8 | p[i];
+  if (auth >> 32)
+    s = sid + sprintf( sid, "S-1-0x%04X%08X", (unsigned)(auth >> 32),
+					      (unsigned)auth );
+  else
+    s = sid + sprintf( sid, "S-1-%u", (unsigned)auth );
+  for (i = 0; i < p[1]; ++i)
+    s += sprintf( s, "-%u", get_u32( p + 8 + 4 * i ) );
+
+  for (i = 0; i < (int)(sizeof(sid_names) / sizeof(*sid_names)); ++i)
+  {
+    if (strcmp( sid, sid_names[i][0] ) == 0)
+    {
+      out_str( o, sid_names[i][1] );
+      return 8 + 4 * p[1];
+    }
+  }
+  out_str( o, sid );
+  return 8 + 4 * p[1];
+}
+
+
+void out_rights( output* o, unsigned mask, const right_name* names )
+{
+  const right_name* r;
+  unsigned rest = mask;
+
+  for (r = key_rights; names == rights && r->name; ++r)
+  {
+    if (mask == r->mask)
+    {
+      out_str( o, r->name );
+      return;
+    }
+  }
+  for (r = names; r->name; ++r)
+    rest &= ~r->mask;
+  if (rest)
+  {
+    out_mem( o, "0x", 2 );
+    out_hex( o, mask, 0 );
+    return;
+  }
+  for (r = names; r->name; ++r)
+    if (mask & r->mask)
+      out_str( o, r->name );
+}
+
+
+void out_guid( output* o, const unsigned char* g )
+{
+  static const char order[] = { 3,2,1,0, -1, 5,4, -1, 7,6, -1, 8,9, -1,
+				10,11,12,13,14,15 };
+  char*  p = out_reserve( o, 36 );
+  size_t i;
+
+  for (i = 0; i < sizeof(order); ++i)
+  {
+    if (order[i] < 0)
+      *p++ = '-';
+    else
+    {
+      *p++ = tolower( hex_digit[g[(int)order[i]] >> 4] );
+      *p++ = tolower( hex_digit[g[(int)order[i]] & 15] );
+    }
+  }
+  o->len += 36;
+}
+
+
+// Write the ACE of LEN bytes at P, returning FALSE if it's not understood.
+BOOL out_ace( output* o, const unsigned char* p, size_t len )
+{
+  const char* type;
+  unsigned obj = 0;
+  size_t   pos = 8;
+  int	   i;
+
+  if (len < 8 || p[0] >= sizeof(ace_types) / sizeof(*ace_types) ||
+      !(type = ace_types[p[0]]))
+    return FALSE;
+  if (OBJECT_ACE( p[0] ))
+  {
+    if (len < 12)
+      return FALSE;
+    obj = get_u32( p + 8 );
+    pos = 12 + ((obj & 1) ? 16 : 0) + ((obj & 2) ? 16 : 0);
+    if (len < pos)
+      return FALSE;
+  }
+
+  out_char( o, '(' );
+  out_str( o, type );
+  out_char( o, ';' );
+  for (i = 0; i < 8; ++i)
+    if ((p[1] & (1 << i)) && ace_flags[i])
+      out_str( o, ace_flags[i] );
+  out_char( o, ';' );
+  out_rights( o, get_u32( p + 4 ), (p[0] == 0x11) ? label_rights : rights );
+  out_char( o, ';' );
+  if (obj & 1)
+    out_guid( o, p + 12 );
+  out_char( o, ';' );
+  if (obj & 2)
+    out_guid( o, p + ((obj & 1) ? 28 : 12) );
+  out_char( o, ';' );
+  if (!out_sid( o, p + pos, len - pos ))
+    out_char( o, '?' );
+  out_char( o, ')' );
+  return TRUE;
+}
+
+
+// Write the ACL at OFF of the descriptor SD (of SIZE bytes), with the flags
+// of CONTROL shifted to the DACL's.
+void out_acl( output* o, const unsigned char* sd, size_t size, unsigned off,
+	      unsigned control )
+{
+  unsigned short len, count, ace;
+  size_t pos;
+
+  if (control & 0x1000)
+    out_char( o, 'P' );
+  if (control & 0x0100)
+    out_mem( o, "AR", 2 );
+  if (control & 0x0400)
+    out_mem( o, "AI", 2 );
+  if (off == 0)
+  {
+    out_str( o, "NO_ACCESS_CONTROL" );
+    return;
+  }
+  if (off > size || size - off < 8)
+  {
+    out_char( o, '?' );
+    return;
+  }
+  memcpy( &len, sd + off + 2, 2 );
+  memcpy( &count, sd + off + 4, 2 );
+  if (len > size - off)
+    len = (unsigned short)(size - off);
+  for (pos = 8; count > 0; --count, pos += ace)
+  {
+    if (pos + 4 > len)
+      break;
+    memcpy( &ace, sd + off + pos + 2, 2 );
+    if (ace < 4 || ace > len - pos)
+      break;
+    if (!out_ace( o, sd + off + pos, ace ))
+      out_str( o, "(?)" );
+  }
+  if (count)
+    out_char( o, '?' );
+}
+
+
+// Write the security descriptor SD of SIZE bytes (self-relative, as a hive
+// keeps it).
+void out_sddl( output* o, const unsigned char* sd, size_t size )
+{
+  unsigned control, owner, group, sacl, dacl;
+
+  if (size < 20 || sd[0] != 1)
+  {
+    out_char( o, '?' );
+    return;
+  }
+  control = sd[2] | sd[3] << 8;
+  owner = get_u32( sd + 4 );
+  group = get_u32( sd + 8 );
+  sacl	= get_u32( sd + 12 );
+  dacl	= get_u32( sd + 16 );
+  if (owner)
+  {
+    out_mem( o, "O:", 2 );
+    if (owner >= size || !out_sid( o, sd + owner, size - owner ))
+      out_char( o, '?' );
+  }
+  if (group)
+  {
+    out_mem( o, "G:", 2 );
+    if (group >= size || !out_sid( o, sd + group, size - group ))
+      out_char( o, '?' );
+  }
+  if (control & 0x0004)
+  {
+    out_mem( o, "D:", 2 );
+    out_acl( o, sd, size, dacl, control );
+  }
+  if (control & 0x0010)
+  {
+    out_mem( o, "S:", 2 );
+    out_acl( o, sd, size, sacl, control >> 1 );
+  }
+}
+
+
+// Write each security descriptor of the hive NAME, following the list of them
+// from that of the ROOT key.  Keys refer to them by the offset of the cell, so
+// each is decoded once, however many keys share it.
+void print_security( output* o, const regf_bins* b, const char* name,
+		     regf_key_block* root )
+{
+  regf_security_block* sk;
+  regf_security_block* next;
+  int	off = root->security;
+
+  if (off == -1)
+    return;
+  sk = regf_security( b, off );
+  while (sk)
+  {
+    if (format == FMT_NDJSON)
+    {
+      out_mem( o, "{\"sk\":", 6 );
+      out_uint( o, (unsigned)off, 0 );
+      out_mem( o, ",\"refs\":", 8 );
+      out_int( o, sk->refs );
+      out_mem( o, ",\"sddl\":\"", 9 );
+      out_sddl( o, sk->descriptor, sk->size );
+      out_mem( o, "\"}\n", 3 );
+    }
+    else
+    {
+      out_mem( o, "[sk:", 4 );
+      out_hex( o, (unsigned)off, 0 );
+      out_mem( o, "] = ", 4 );
+      out_sddl( o, sk->descriptor, sk->size );
+      out_char( o, '\n' );
+    }
+    if (sk->flink == root->security)
+      return;
+    // The list is doubly linked, so checking the way back also stops a loop.
+    next = regf_security( b, sk->flink );
+    if (next && next->blink != off)
+      next = NULL;
+    off = sk->flink;
+    sk = next;
+  }
+  fprintf( stderr, "%s: security list is broken.\n", name );
+}
+
+
+// Print the line for an empty key (or every key, with "-k" or "--security").
+void print_key( walker* w, regf_key_block* key, size_t path )
+{
+  output* out = w->out;
+
+  if (format != FMT_TEXT)
+  {
+    print_key_record( w, key, path );
+    return;
+  }
+
+  if (w->prefix)
+    out_str( out, w->prefix );
+  if (time_sec || time_full)
+    print_time( out, &w->times, key->timestamp, time_full, TRUE );
+  if (hex_type && !only_keys && !w->group)
+    out_mem( out, "                    ", 20 );
+  out_mem( out, w->full, path );
+  if (show_security)
+  {
+    out_mem( out, " [sk:", 5 );
+    out_hex( out, (unsigned)key->security, 0 );
+    out_char( out, ']' );
+  }
+  out_char( out, '\n' );
+}
+
+
+// Start walking KEY, adding its name to the path; its values are printed
+// unless only the keys are wanted (or it's too old).
+int enter_key( void* ctx, regf_walker* rw, regf_key_block* key )
+{
+  walker* w = ctx;
+  frame* f;
+  regf_list_block* list;
+  int	visit;
+  int64_t t = 0;
+
+  if (rw->depth > w->stack_size)
+  {
+    w->stack_size = (w->stack_size) ? w->stack_size * 2 : 32;
+    w->stack = xrealloc( w->stack, w->stack_size * sizeof(frame) );
+  }
+  f = &w->stack[rw->depth - 1];
+  f->path = add_name( w, (rw->depth == 1) ? w->base : f[-1].path,
+		      key->name, key->len, key->flags & REGF_KEY_COMP_NAME );
+  visit = (w->shallow) ? 0 : REGF_SUBKEYS;
+
+  if (w->stats)
+  {
+    ++w->stats->keys;
+    if (w->base_depth + rw->depth > w->stats->deepest)
+    {
+      w->stats->deepest = w->base_depth + rw->depth;
+      w->stats->deepest_len = f->path;
+      w->stats->deepest_path = xrealloc( w->stats->deepest_path, f->path );
+      memcpy( w->stats->deepest_path, w->full, f->path );
+    }
+    t = wall_clock();
+  }
+  if (w->index)
+  {
+    add_entry( w, key, f->path );
+    f->leave_key = special_key( w, key );
+    f->empty_key = FALSE;
+  }
+  else if (w->since && key->timestamp <= w->since)
+  {
+    // Its subkeys may still be newer, so they are still walked.
+    f->leave_key = special_key( w, key );
+    f->empty_key = FALSE;
+  }
+  else if (only_keys)
+  {
+    print_key( w, key, f->path );
+    f->empty_key = FALSE;
+    f->leave_key = NULL;
+  }
+  else
+  {
+    f->leave_key = special_key( w, key );
+    f->empty_key = (key->value_count == 0);
+    if ((show_security && !only_values) || (w->group && !f->empty_key))
+    {
+      print_key( w, key, f->path );
+      f->empty_key = FALSE;
+    }
+    visit |= REGF_VALUES;
+  }
+  if (w->stats)
+    w->stats->wall[PHASE_FORMAT] += wall_clock() - t;
+
+  // For simplicity we can imagine keys as directories in filesystem and values
+  // as files.	Once the values of this dir are dumped, its subdirectories are
+  // walked in the same way.
+  if (key->subkeys != -1 && (list = regf_subkey_list( &rw->bins, key->subkeys ))
+      && list->count)
+    f->empty_key = FALSE;
+  return visit;
+}
+
+
+void enter_value( void* ctx, regf_walker* rw, regf_key_block* key,
+		  regf_value_block* val, regf_value_data* vd )
+{
+  walker* w = ctx;
+  int64_t t;
+
+  if (w->stats)
+  {
+    ++w->stats->values;
+    t = wall_clock();
+    print_value( w, key, val, vd, w->stack[rw->depth - 1].path );
+    w->stats->wall[PHASE_FORMAT] += wall_clock() - t;
+  }
+  else
+    print_value( w, key, val, vd, w->stack[rw->depth - 1].path );
+}
+
+
+void leave_key( void* ctx, regf_walker* rw, regf_key_block* key )
+{
+  walker* w = ctx;
+  frame* f = &w->stack[rw->depth - 1];
+  int64_t t;
+
+  if (f->empty_key && !only_values)
+  {
+    if (w->stats)
+    {
+      t = wall_clock();
+      print_key( w, key, f->path );
+      w->stats->wall[PHASE_FORMAT] += wall_clock() - t;
+    }
+    else
+      print_key( w, key, f->path );
+  }
+
+  if (f->leave_key)
+    *f->leave_key = FALSE;
+}
+
+
+void walk_error( void* ctx, regf_walker* rw, const char* msg )
+{
+  walker* w = ctx;
+
+  w->full[w->stack[rw->depth - 1].path] = '\0';
+  fprintf( stderr, "%s: %s.\n", w->full, msg );
+}
+
+
+static const regf_visitor printer =
+  { enter_key, enter_value, leave_key, walk_error };
+
+
+// Walk KEY and all its subkeys, adding to the path at PATH.
+void walk( walker* w, size_t path, regf_key_block* key )
+{
+  size_t i;
+  stamp t;
+
+  w->base = path;
+  w->rw.bins = w->bins;
+  if (!w->stats)
+  {
+    regf_walk( &w->rw, key, &printer, w );
+    return;
+  }
+
+  // The depth of the keys above the walk, for the deepest key.
+  start_phase( &t );
+  w->base_depth = 0;
+  for (i = 0; i < path; ++i)
+    if (w->full[i] == '/')
+      ++w->base_depth;
+  regf_walk( &w->rw, key, &printer, w );
+  end_phase( w->stats, PHASE_WALK, &t );
+}
+
+
+// A key name to search for, as it would be printed.
+typedef struct
+{
+  const char* name;
+  size_t len;
+  BOOL	 simple;		// plain ASCII, so the hashes can be checked
+  unsigned hash;		// as stored in "lh" lists
+} key_name;
+
+
+// Compare the printed name at P with KN, ignoring case.
+BOOL same_name( const char* p, size_t len, key_name* kn )
+{
+  size_t i;
+
+  if (len != kn->len)
+    return FALSE;
+  for (i = 0; i < len; ++i)
+    if (toupper( (unsigned char)p[i] ) != toupper( (unsigned char)kn->name[i] ))
+      return FALSE;
+  return TRUE;
+}
+
+
+// Check the "lf" hint, which is the first four characters of the name (as
+// stored, with nulls if it's shorter, or a null first if it's not ASCII).
+BOOL hint_match( const unsigned char* hint, key_name* kn )
+{
+  size_t i;
+
+  if (hint[0] == 0)
+    return TRUE;
+  for (i = 0; i < 4; ++i)
+  {
+    if (hint[i] == 0)
+      return (i == kn->len);
+    if (hint[i] >= 0x80)
+      return TRUE;
+    if (i >= kn->len ||
+	toupper( hint[i] ) != toupper( (unsigned char)kn->name[i] ))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+
+// Look through a list of keys for KN.  If the list has hashes, keys that can't
+// match are rejected without reading them.
+regf_key_block* search_list( walker* w, regf_list_block* item, size_t end,
+			     key_name* kn, size_t* next )
+{
+  regf_key_block* key;
+  int	ii = (item->block_type[1] == 'i') ? 1 : 2;
+  int*	entry;
+  int	i;
+
+  for (i = 0, entry = item->offsets; i < item->count; ++i, entry += ii)
+  {
+    if (ii == 2 && kn->simple)
+    {
+      if (item->block_type[1] == 'h')
+      {
+	if ((unsigned)entry[1] != kn->hash)
+	  continue;
+      }
+      else if (!hint_match( (unsigned char*)(entry + 1), kn ))
+	continue;
+    }
+    key = regf_key( &w->bins, *entry );
+    if (!key)
+      continue;
+    *next = add_name( w, end, key->name, key->len,
+		      key->flags & REGF_KEY_COMP_NAME );
+    if (same_name( w->full + end + 1, *next - end - 1, kn ))
+      return key;
+  }
+  return NULL;
+}
+
+
+// Find the key at PATH (as it would be printed, but ignoring case), starting
+// from the root KEY.  The path of its parent is left in the walker, ending at
+// END, along with the special keys it's under.  Returns NULL if there's no
+// such key.
+regf_key_block* find_key( walker* w, regf_key_block* key, const char* path,
+			  size_t* end )
+{
+  key_name kn;
+  regf_list_block* item;
+  regf_list_block* list;
+  regf_key_block* found;
+  const char* p;
+  size_t next;
+  int	i;
+
+  *end = 0;
+  while (*path == '/')
+    ++path;
+  if (*path == '\0')
+    return key;
+
+  for (found = NULL;;)
+  {
+    for (p = path; *p && *p != '/'; ++p) ;
+    kn.name = path;
+    kn.len = p - path;
+    kn.simple = TRUE;
+    kn.hash = 0;
+    for (; path < p; ++path)
+    {
+      // Escaped characters would have to be decoded, so don't use the hashes.
+      if (*path < 32 || *path >= 127 || *path == '<')
+	kn.simple = FALSE;
+      kn.hash = kn.hash * 37 + toupper( (unsigned char)*path );
+    }
+
+    if (!found)
+    {
+      // The root, which has no list.
+      next = add_name( w, 0, key->name, key->len,
+		       key->flags & REGF_KEY_COMP_NAME );
+      if (!same_name( w->full + 1, next - 1, &kn ))
+	return NULL;
+    }
+    else
+    {
+      special_key( w, key );
+      *end = next;
+      if (key->subkeys == -1 || key->subkey_count == 0)
+	return NULL;
+      item = regf_subkey_list( &w->bins, key->subkeys );
+      if (!item)
+	key = NULL;
+      else if (item->block_type[0] == 'l')
+	key = search_list( w, item, *end, &kn, &next );
+      else
+      {
+	// In case of too many subkeys this list contains just other lists.
+	for (i = 0; i < item->count; ++i)
+	{
+	  list = regf_subkey_list( &w->bins, item->offsets[i] );
+	  key = (list && list->block_type[0] == 'l')
+		? search_list( w, list, *end, &kn, &next ) : NULL;
+	  if (key)
+	    break;
+	}
+	if (i == item->count)
+	  key = NULL;
+      }
+      if (!key)
+	return NULL;
+    }
+    found = key;
+
+    while (*path == '/')
+      ++path;
+    if (*path == '\0')
+      return found;
+  }
+}
+
+
+// Compare paths, ignoring case.
+int compare_path( const char* a, size_t alen, const char* b, size_t blen )
+{
+  size_t i;
+  int	 c;
+
+  for (i = 0; i < alen && i < blen; ++i)
+  {
+    c = toupper( (unsigned char)a[i] ) - toupper( (unsigned char)b[i] );
+    if (c)
+      return c;
+  }
+  return (alen < blen) ? -1 : (alen > blen);
+}
+
+
+static const char* sort_names;	// qsort has no context
+
+int compare_entry( const void* a, const void* b )
+{
+  const index_entry* ea = a;
+  const index_entry* eb = b;
+
+  return compare_path( sort_names + ea->path, ea->len,
+		       sort_names + eb->path, eb->len );
+}
+
+
+// Read the index of the hive, returning FALSE if it's missing or stale.
+BOOL read_index( const char* name, regf_hive* h, key_index* x )
+{
+  regf_base_block* regf = (regf_base_block*)h->data;
+  index_header* ih;
+  FILE* f;
+  long	size;
+  int	i;
+
+  f = fopen( name, "rb" );
+  if (!f)
+    return FALSE;
+  fseek( f, 0, SEEK_END );
+  size = ftell( f );
+  rewind( f );
+  if (size < (long)sizeof(index_header))
+  {
+    fclose( f );
+    return FALSE;
+  }
+  x->file = xrealloc( NULL, size );
+  if (fread( x->file, size, 1, f ) != 1)
+    goto stale;
+  fclose( f );
+  f = NULL;
+
+  ih = (index_header*)x->file;
+  if (memcmp( ih->signature, "rdix", 4 ) != 0 ||
+      ih->version != INDEX_VERSION ||
+      ih->sequence != regf->primary_sequence_number ||
+      memcmp( ih->timestamp, regf->last_written_timestamp, 8 ) != 0 ||
+      ih->utf8 != (format != FMT_TEXT) ||
+      ih->count < 0 || ih->names_size < 0 ||
+      (size - sizeof(index_header)) / sizeof(index_entry) < (size_t)ih->count ||
+      (size_t)size != sizeof(index_header) + ih->count * sizeof(index_entry)
+		      + ih->names_size)
+    goto stale;
+
+  x->entry = (index_entry*)(ih + 1);
+  x->count = ih->count;
+  x->names.buf = (char*)(x->entry + x->count);
+  x->names.len = ih->names_size;
+  for (i = 0; i < x->count; ++i)
+  {
+    index_entry* e = &x->entry[i];
+    if (e->path > x->names.len || e->len > x->names.len - e->path ||
+	e->offset < 0 ||
+	(size_t)e->offset + 0x1000 + sizeof(regf_key_block) > h->size)
+      goto stale;
+  }
+  return TRUE;
+
+stale:
+  if (f)
+    fclose( f );
+  free( x->file );
+  memset( x, 0, sizeof(*x) );
+  return FALSE;
+}
+
+
+// Write the index; it doesn't matter if it can't be, it will just be built
+// again next time.
+void write_index( const char* name, regf_hive* h, key_index* x )
+{
+  regf_base_block* regf = (regf_base_block*)h->data;
+  index_header ih;
+  FILE* f;
+
+  memcpy( ih.signature, "rdix", 4 );
+  ih.version = INDEX_VERSION;
+  ih.sequence = regf->primary_sequence_number;
+  memcpy( ih.timestamp, regf->last_written_timestamp, 8 );
+  ih.utf8 = (format != FMT_TEXT);
+  ih.count = x->count;
+  ih.names_size = (int)x->names.len;
+
+  f = fopen( name, "wb" );
+  if (!f)
+    return;
+  if (fwrite( &ih, sizeof(ih), 1, f ) != 1 ||
+      fwrite( x->entry, sizeof(index_entry), x->count, f ) != (size_t)x->count ||
+      fwrite( x->names.buf, 1, x->names.len, f ) != x->names.len)
+  {
+    fclose( f );
+    remove( name );
+    return;
+  }
+  fclose( f );
+}
+
+
+// Read the index for the hive NAME, building it from the ROOT key if it needs
+// to be.
+void load_index( const char* name, regf_hive* h, walker* w,
+		 regf_key_block* root, key_index* x )
+{
+  char* file;
+  BOOL	shallow = w->shallow;
+  int64_t since = w->since;
+
+  memset( x, 0, sizeof(*x) );
+  file = xrealloc( NULL, strlen( name ) + 5 );
+  strcpy( file, name );
+  strcat( file, ".idx" );
+  if (!read_index( file, h, x ))
+  {
+    // Whatever the walker was last asked for, the index has every key.
+    w->index = x;
+    w->shallow = FALSE;
+    w->since = 0;
+    w->properties = w->driverpackages = FALSE;
+    walk( w, 0, root );
+    w->index = NULL;
+    w->shallow = shallow;
+    w->since = since;
+    w->properties = w->driverpackages = FALSE;
+    sort_names = x->names.buf;
+    qsort( x->entry, x->count, sizeof(index_entry), compare_entry );
+    write_index( file, h, x );
+  }
+  free( file );
+}
+
+
+void free_index( key_index* x )
+{
+  if (x->file)
+    free( x->file );
+  else
+  {
+    free( x->entry );
+    free( x->names.buf );
+  }
+}
+
+
+// Find the key at PATH using the index, as find_key() does.
+regf_key_block* index_key( walker* w, key_index* x, const char* path,
+			   size_t* end )
+{
+  index_entry* e;
+  char*  want;
+  size_t len;
+  int	 lo, hi, mid, c;
+
+  // Write the path the way it's stored: "/A/B", without repeated slashes.
+  path_reserve( w, 0, strlen( path ) + 2 );
+  want = w->full;
+  for (len = 0; *path; )
+  {
+    while (*path == '/')
+      ++path;
+    if (*path == '\0')
+      break;
+    want[len++] = '/';
+    while (*path && *path != '/')
+      want[len++] = *path++;
+  }
+
+  for (lo = 0, hi = x->count - 1; lo <= hi; )
+  {
+    mid = (lo + hi) / 2;
+    e = &x->entry[mid];
+    c = compare_path( x->names.buf + e->path, e->len, want, len );
+    if (c == 0)
+    {
+      regf_key_block* key = regf_key( &w->bins, e->offset );
+      if (!key)
+	return NULL;
+      path_reserve( w, 0, e->len + 1 );
+      memcpy( w->full, x->names.buf + e->path, e->len );
+      *end = e->len;
+      while (*end > 0 && w->full[--*end] != '/') ;
+      w->properties = (e->flags & UNDER_PROPERTIES) != 0;
+      w->driverpackages = (e->flags & UNDER_DRIVERPACKAGES) != 0;
+      return key;
+    }
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return NULL;
+}
+
+
+// A subkey or value of a key being compared, by its name (as printed).
+typedef struct
+{
+  size_t name, len;		// in the names of the list
+  void*  cell;
+} diff_item;
+
+typedef struct
+{
+  diff_item* item;
+  int	 count;
+  output names;
+} diff_list;
+
+
+static diff_list* sort_list;	// qsort has no context
+
+int compare_item( const void* a, const void* b )
+{
+  const diff_item* ia = a;
+  const diff_item* ib = b;
+
+  return compare_path( sort_list->names.buf + ia->name, ia->len,
+		       sort_list->names.buf + ib->name, ib->len );
+}
+
+
+void add_item( diff_list* l, void* cell, char* name, int len, int comp )
+{
+  diff_item* i;
+  char* p;
+
+  l->item = xrealloc( l->item, (l->count + 1) * sizeof(diff_item) );
+  i = &l->item[l->count++];
+  i->cell = cell;
+  i->name = l->names.len;
+  p = out_reserve( &l->names, 1 + len * (size_t)(comp ? 4 : 3) );
+  i->len = (len == 0) ? 0 : make_name( p, name, len, comp ) - p;
+  l->names.len += i->len;
+}
+
+
+void sort_items( diff_list* l )
+{
+  sort_list = l;
+  qsort( l->item, l->count, sizeof(diff_item), compare_item );
+}
+
+
+void free_list( diff_list* l )
+{
+  free( l->item );
+  free( l->names.buf );
+}
+
+
+void list_values( walker* w, regf_key_block* key, diff_list* l )
+{
+  regf_offsets* val_list = regf_values( &w->bins, key );
+  regf_value_block* val;
+  int	o;
+
+  memset( l, 0, sizeof(*l) );
+  for (o = 0; val_list && o < key->value_count; ++o)
+  {
+    val = regf_value( &w->bins, val_list->offsets[o] );
+    if (val)
+      add_item( l, val, val->name, val->name_len,
+		val->flags & REGF_VALUE_COMP_NAME );
+  }
+  sort_items( l );
+}
+
+
+void list_subkeys( walker* w, regf_key_block* key, diff_list* l )
+{
+  regf_subkey_iter it;
+  regf_key_block* sub;
+
+  memset( l, 0, sizeof(*l) );
+  regf_first_subkey( &w->bins, key, &it );
+  while ((sub = regf_next_subkey( &w->bins, &it )) != NULL)
+    add_item( l, sub, sub->name, sub->len, sub->flags & REGF_KEY_COMP_NAME );
+  sort_items( l );
+}
+
+
+// See if two values have the same type and data.
+BOOL same_value( walker* wo, regf_value_block* vo,
+		 walker* wn, regf_value_block* vn )
+{
+  regf_value_data o, n;
+  int	so, sn, lo, ln, k;
+  char	*po = NULL, *pn = NULL;
+
+  if (vo->value_type != vn->value_type)
+    return FALSE;
+  regf_data( &wo->bins, vo, &o );
+  regf_data( &wn->bins, vn, &n );
+  if (o.size != n.size)
+    return FALSE;
+
+  // The segments are the same size, but a small value could be in the key.
+  for (so = sn = 0, lo = ln = 0;;)
+  {
+    if (lo == 0)
+    {
+      if (so == regf_segment_count( &o ))
+	return TRUE;
+      po = regf_segment( &o, so++, &lo );
+    }
+    if (ln == 0)
+      pn = regf_segment( &n, sn++, &ln );
+    k = (lo < ln) ? lo : ln;
+    if (memcmp( po, pn, k ) != 0)
+      return FALSE;
+    po += k; lo -= k;
+    pn += k; ln -= k;
+  }
+}
+
+
+// Compare two hives, one key at a time.  Rather than recursing, the keys
+// being compared are kept on a stack, along with their subkeys, as regf_walk
+// does.
+typedef struct
+{
+  regf_key_block *ko, *kn;	// the matching keys
+  size_t path;			// where their path ends
+  diff_list lo, ln;		// their subkeys
+  int	 io, in;		// the next of each to compare
+  BOOL	 *leave_old, *leave_new;
+} diff_frame;
+
+typedef struct
+{
+  walker old, new;		// with the paths kept the same
+  diff_frame* stack;		// the keys leading to the current one
+  int	 depth;
+} differ;
+
+
+// Write KEY (and its subkeys) from the old hive, at the path of the new.
+void diff_removed( differ* d, regf_key_block* key, size_t path )
+{
+  path_reserve( &d->old, 0, path + 1 );
+  memcpy( d->old.full, d->new.full, path );
+  walk( &d->old, path, key );
+}
+
+
+// See if KEY has a line of its own: every key with "-k", otherwise only if
+// it's empty.
+BOOL key_line( walker* w, regf_key_block* key )
+{
+  regf_subkey_iter it;
+
+  if (only_keys)
+    return TRUE;
+  if (only_values || key->value_count != 0)
+    return FALSE;
+  regf_first_subkey( &w->bins, key, &it );
+  return !(it.list && it.list->count);
+}
+
+
+// Compare the lines and values of the matching keys KO and KN, whose path
+// ends at PATH.
+void diff_key( differ* d, regf_key_block* ko, regf_key_block* kn, size_t path )
+{
+  diff_list lo, ln;
+  BOOL	changed, line_old, line_new;
+  int	io, in, c;
+
+  // The key's own line only changes if it's there in just one, or its time.
+  line_old = key_line( &d->old, ko );
+  line_new = key_line( &d->new, kn );
+  changed = (line_old && line_new &&
+	     ((time_full && ko->timestamp != kn->timestamp) ||
+	      (time_sec && ko->timestamp / 10000000 != kn->timestamp / 10000000)));
+  if (line_old && (!line_new || changed))
+  {
+    path_reserve( &d->old, 0, path + 1 );
+    memcpy( d->old.full, d->new.full, path );
+    print_key( &d->old, ko, path );
+  }
+  if (line_new && (!line_old || changed))
+    print_key( &d->new, kn, path );
+
+  // Changing a value changes the key's time, so the same time (and number)
+  // means the same values.
+  if (!only_keys &&
+      (ko->timestamp != kn->timestamp || ko->value_count != kn->value_count))
+  {
+    list_values( &d->old, ko, &lo );
+    list_values( &d->new, kn, &ln );
+    for (io = in = 0; io < lo.count || in < ln.count; )
+    {
+      if (io == lo.count)
+	c = 1;
+      else if (in == ln.count)
+	c = -1;
+      else
+	c = compare_path( lo.names.buf + lo.item[io].name, lo.item[io].len,
+			  ln.names.buf + ln.item[in].name, ln.item[in].len );
+      changed = (c == 0 && !same_value( &d->old, lo.item[io].cell,
+					 &d->new, ln.item[in].cell ));
+      if (c < 0 || changed)
+      {
+	path_reserve( &d->old, 0, path + 1 );
+	memcpy( d->old.full, d->new.full, path );
+	print_cell( &d->old, ko, lo.item[io].cell, path );
+      }
+      if (c > 0 || changed)
+	print_cell( &d->new, kn, ln.item[in].cell, path );
+      if (c <= 0)
+	++io;
+      if (c >= 0)
+	++in;
+    }
+    free_list( &lo );
+    free_list( &ln );
+  }
+}
+
+
+// Compare the matching keys KO and KN, whose path ends at PATH, and start on
+// their subkeys.
+void diff_enter( differ* d, regf_key_block* ko, regf_key_block* kn,
+		 size_t path )
+{
+  diff_frame* f;
+
+  if (!d->stack)
+    d->stack = xrealloc( NULL, (REGF_MAX_DEPTH + 1) * sizeof(diff_frame) );
+  f = &d->stack[d->depth++];
+  f->ko = ko;
+  f->kn = kn;
+  f->path = path;
+  f->io = f->in = 0;
+  f->leave_old = special_key( &d->old, ko );
+  f->leave_new = special_key( &d->new, kn );
+
+  diff_key( d, ko, kn, path );
+
+  if (d->depth > REGF_MAX_DEPTH)
+  {
+    memset( &f->lo, 0, sizeof(f->lo) );
+    memset( &f->ln, 0, sizeof(f->ln) );
+    d->new.full[path] = '\0';
+    fprintf( stderr, "%s: subkeys nested too deeply.\n", d->new.full );
+    return;
+  }
+  list_subkeys( &d->old, ko, &f->lo );
+  list_subkeys( &d->new, kn, &f->ln );
+}
+
+
+// Compare KO and KN, and all their subkeys, matching them by name.
+void diff_tree( differ* d, regf_key_block* ko, regf_key_block* kn,
+		size_t path )
+{
+  diff_frame* f;
+  regf_key_block *so, *sn;
+  size_t end;
+  int	c, a;
+
+  diff_enter( d, ko, kn, path );
+  while (d->depth)
+  {
+    f = &d->stack[d->depth - 1];
+    if (f->io == f->lo.count && f->in == f->ln.count)
+    {
+      free_list( &f->lo );
+      free_list( &f->ln );
+      if (f->leave_old)
+	*f->leave_old = FALSE;
+      if (f->leave_new)
+	*f->leave_new = FALSE;
+      --d->depth;
+      continue;
+    }
+
+    if (f->io == f->lo.count)
+      c = 1;
+    else if (f->in == f->ln.count)
+      c = -1;
+    else
+      c = compare_path( f->lo.names.buf + f->lo.item[f->io].name,
+			f->lo.item[f->io].len,
+			f->ln.names.buf + f->ln.item[f->in].name,
+			f->ln.item[f->in].len );
+    so = (c <= 0) ? f->lo.item[f->io++].cell : NULL;
+    sn = (c >= 0) ? f->ln.item[f->in++].cell : NULL;
+    if (!sn)
+      diff_removed( d, so, f->path );
+    else if (!so)
+      walk( &d->new, f->path, sn );
+    else
+    {
+      for (a = 0; a < d->depth && d->stack[a].kn != sn; ++a) ;
+      if (a < d->depth)
+      {
+	d->new.full[f->path] = '\0';
+	fprintf( stderr, "%s: subkey loops back to an ancestor.\n",
+		 d->new.full );
+	continue;
+      }
+      end = add_name( &d->new, f->path, sn->name, sn->len,
+		      sn->flags & REGF_KEY_COMP_NAME );
+      diff_enter( d, so, sn, end );
+    }
+  }
+}
+
+
+void report_error( const char* name, regf_hive* h )
+{
+  if (h->errmsg)
+    fprintf( stderr, "%s: %s.\n", name, h->errmsg );
+  else
+    fprintf( stderr, "%s: %s\n", name, strerror( h->error ) );
+}
+
+
+// Compare the hive OLD with NEW, writing the values that have been removed
+// ("- ") or added ("+ "), or both if changed, as well as any whole subkeys.
+int diff_hives( const char* old_name, const char* new_name, output* out )
+{
+  regf_hive	 ho, hn;
+  differ d;
+  regf_key_block *ko, *kn;
+  size_t end;
+
+  if (!regf_load( old_name, &ho, !raw_hive ))
+  {
+    report_error( old_name, &ho );
+    return 1;
+  }
+  if (!regf_load( new_name, &hn, !raw_hive ))
+  {
+    report_error( new_name, &hn );
+    regf_unload( &ho );
+    return 1;
+  }
+
+  memset( &d, 0, sizeof(d) );
+  d.old.out = d.new.out = out;
+  d.old.prefix = "- ";
+  d.new.prefix = "+ ";
+  set_head( &d.old );
+  set_head( &d.new );
+  ko = regf_root( &d.old.bins, &ho );
+  kn = regf_root( &d.new.bins, &hn );
+
+  end = add_name( &d.new, 0, kn->name, kn->len,
+		  kn->flags & REGF_KEY_COMP_NAME );
+  diff_tree( &d, ko, kn, end );
+  out_flush( out );
+
+  free( d.old.full );
+  free_names( &d.old.names );
+  free( d.old.stack );
+  regf_free( &d.old.rw );
+  free( d.new.full );
+  free_names( &d.new.names );
+  free( d.new.stack );
+  regf_free( &d.new.rw );
+  free( d.stack );
+  regf_unload( &ho );
+  regf_unload( &hn );
+  return 0;
+}
+
+
+// Scanning goes through the cells in the order of the file, rather than
+// walking the keys, so it also finds the keys and values that are no longer
+// linked, or have been freed (deleted).  Each cell is a line: its offset,
+// "used" or "free", its signature ("--" for data) and its size; keys and
+// values add the line of the walk.  A key's path is rebuilt from its parents,
+// starting with "?" if they don't lead to the root; a value's path is that of
+// the key listing it (preferring a used key), or just "?".
+typedef struct
+{
+  int  value;			// offset of a value
+  int  key;			// the key listing it
+  BOOL free_key;		// the key's cell is free
+} owner;
+
+typedef struct
+{
+  walker w;
+  owner* owners;
+  int	 count, size;
+} scanner;
+
+typedef struct
+{
+  size_t bin, end;		// the current bin
+  size_t cell;			// offset of the next cell
+} cell_iter;
+
+
+// Start iterating the cells of the bin at BIN; a bin without a signature
+// has no cells, so the next page is tried.
+void enter_bin( scanner* s, cell_iter* it, size_t bin )
+{
+  char* p = s->w.bins.root + bin;
+  int	len;
+
+  it->bin = it->end = bin;
+  it->cell = bin + 0x20;
+  if (bin + 0x20 <= s->w.bins.size && memcmp( p, "hbin", 4 ) == 0)
+  {
+    len = *(int*)(p + 8);
+    if (len >= 0x1000 && (len & 0xFFF) == 0 && bin + len <= s->w.bins.size)
+      it->end = bin + len;
+  }
+}
+
+
+// Return the next cell, setting its offset and size (negative if used), or
+// NULL when there are no more.  A cell with a bad size skips the rest of its
+// bin.
+char* next_cell( scanner* s, cell_iter* it, int* off, int* size )
+{
+  int len;
+
+  for (;;)
+  {
+    if (it->cell + 8 <= it->end)
+    {
+      *size = *(int*)(s->w.bins.root + it->cell);
+      len = (*size < 0) ? (int)(0u - (unsigned)*size) : *size;
+      if (len >= 8 && (len & 7) == 0 && it->cell + len <= it->end)
+      {
+	*off = (int)it->cell;
+	it->cell += len;
+	return s->w.bins.root + *off;
+      }
+    }
+    if (it->bin >= s->w.bins.size)
+      return NULL;
+    enter_bin( s, it, (it->end > it->bin) ? it->end : it->bin + 0x1000 );
+  }
+}
+
+
+// Return the signature of CELL, or "--" if it's data.
+const char* cell_type( const char* cell )
+{
+  static const char types[] = "nkvkskdblflhliri";
+  int i;
+
+  for (i = 0; types[i]; i += 2)
+    if (cell[4] == types[i] && cell[5] == types[i+1])
+      return types + i;
+  return "--";
+}
+
+
+int compare_owner( const void* a, const void* b )
+{
+  const owner* oa = a;
+  const owner* ob = b;
+
+  if (oa->value != ob->value)
+    return (oa->value < ob->value) ? -1 : 1;
+  return oa->free_key - ob->free_key;
+}
+
+
+// Remember the key listing each value.
+void add_owners( scanner* s, regf_key_block* key, int off, BOOL free_key )
+{
+  regf_offsets* val_list;
+  owner* o;
+  int	i;
+
+  if (key->value_count <= 0)
+    return;
+  val_list = regf_values( &s->w.bins, key );
+  if (!val_list)
+    return;
+  for (i = 0; i < key->value_count; ++i)
+  {
+    if (s->count == s->size)
+    {
+      s->size = (s->size) ? s->size * 2 : 0x1000;
+      s->owners = xrealloc( s->owners, s->size * sizeof(owner) );
+    }
+    o = &s->owners[s->count++];
+    o->value = val_list->offsets[i];
+    o->key = off;
+    o->free_key = free_key;
+  }
+}
+
+
+// Return the key listing the value at OFF, or NULL.
+regf_key_block* find_owner( scanner* s, int off )
+{
+  int lo = 0, hi = s->count, mid;
+
+  while (lo < hi)
+  {
+    mid = (lo + hi) / 2;
+    if (s->owners[mid].value < off)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < s->count && s->owners[lo].value == off)
+    return regf_key( &s->w.bins, s->owners[lo].key );
+  return NULL;
+}
+
+
+// Build the path of KEY from its parents, returning its end.
+size_t key_path( scanner* s, regf_key_block* key )
+{
+  regf_key_block* chain[REGF_MAX_DEPTH];
+  int	n = 0;
+  size_t end = 0;
+
+  while (key && n < REGF_MAX_DEPTH)
+  {
+    chain[n++] = key;
+    if (key->flags & REGF_KEY_HIVE_ENTRY)
+      break;
+    key = regf_key( &s->w.bins, key->parent );
+  }
+  if (!(chain[n-1]->flags & REGF_KEY_HIVE_ENTRY))
+  {
+    path_reserve( &s->w, 0, 1 );
+    s->w.full[end++] = '?';
+  }
+  while (n > 0)
+  {
+    key = chain[--n];
+    end = add_name( &s->w, end, key->name, key->len,
+		    key->flags & REGF_KEY_COMP_NAME );
+  }
+  return end;
+}
+
+
+void scan_value( scanner* s, regf_value_block* val, int off )
+{
+  regf_key_block* key = find_owner( s, off );
+  regf_key_block  none;
+  regf_value_data vd;
+  size_t path, end;
+
+  if (key)
+    path = key_path( s, key );
+  else
+  {
+    // Without a key, there's no time either.
+    memset( &none, 0, sizeof(none) );
+    key = &none;
+    path_reserve( &s->w, 0, 1 );
+    s->w.full[0] = '?';
+    path = 1;
+  }
+  if (regf_data( &s->w.bins, val, &vd ))
+  {
+    print_value( &s->w, key, val, &vd, path );
+    return;
+  }
+
+  // The data has been reused, so only the name is left.
+  if (val->name_len == 0)
+  {
+    path_reserve( &s->w, path, 3 );
+    memcpy( s->w.full + path, "/@", 3 );
+    end = path + 2;
+  }
+  else
+    end = add_name( &s->w, path, val->name, val->name_len,
+		    val->flags & REGF_VALUE_COMP_NAME );
+  out_str( s->w.out, s->w.prefix );
+  out_mem( s->w.out, s->w.full, end );
+  out_mem( s->w.out, " [", 2 );
+  out_int( s->w.out, val->value_type );
+  out_char( s->w.out, ':' );
+  out_int( s->w.out, val->size & 0x7fffffff );
+  out_mem( s->w.out, "] <lost>\n", 9 );
+}
+
+
+int scan_hive( const char* name, output* out )
+{
+  regf_hive	h;
+  scanner s;
+  cell_iter it;
+  char* cell;
+  char	prefix[32];
+  int	off, size;
+  regf_key_block* key;
+  regf_value_block* val;
+
+  if (!regf_load( name, &h, !raw_hive ))
+  {
+    out_flush( out );
+    report_error( name, &h );
+    return 1;
+  }
+
+  memset( &s, 0, sizeof(s) );
+  s.w.out = out;
+  s.w.prefix = prefix;
+  set_head( &s.w );
+  regf_root( &s.w.bins, &h );
+
+  // Used keys come first, so their values don't take the path of a free one.
+  enter_bin( &s, &it, 0 );
+  while ((cell = next_cell( &s, &it, &off, &size )) != NULL)
+  {
+    if ((key = regf_key( &s.w.bins, off )) != NULL)
+      add_owners( &s, key, off, size > 0 );
+  }
+  qsort( s.owners, s.count, sizeof(owner), compare_owner );
+
+  enter_bin( &s, &it, 0 );
+  while ((cell = next_cell( &s, &it, &off, &size )) != NULL)
+  {
+    sprintf( prefix, "%08X %s %.2s %d ", off, (size < 0) ? "used" : "free",
+	     cell_type( cell ), (size < 0) ? -size : size );
+    if ((key = regf_key( &s.w.bins, off )) != NULL)
+      print_key( &s.w, key, key_path( &s, key ) );
+    else if ((val = regf_value( &s.w.bins, off )) != NULL)
+      scan_value( &s, val, off );
+    else
+    {
+      prefix[strlen( prefix ) - 1] = '\n';
+      out_str( out, prefix );
+    }
+  }
+  out_flush( out );
+
+  free( s.w.full );
+  free_names( &s.w.names );
+  free( s.owners );
+  regf_unload( &h );
+  return 0;
+}
+
+
+// Read a line of F into *LINE (of *SIZE, grown to fit), without its newline.
+// Returns NULL at the end of the file.
+char* read_line( FILE* f, char** line, size_t* size )
+{
+  size_t len = 0;
+
+  for (;;)
+  {
+    if (*size - len < 2)
+    {
+      *size = (*size) ? *size * 2 : 0x1000;
+      *line = xrealloc( *line, *size );
+    }
+    if (!fgets( *line + len, (int)(*size - len), f ))
+    {
+      if (len == 0)
+	return NULL;
+      break;
+    }
+    len += strlen( *line + len );
+    if (len && (*line)[len-1] == '\n')
+      break;
+  }
+  (*line)[strcspn( *line, "\r\n" )] = '\0';
+  return *line;
+}
+
+
+// The state of each hive at the last sweep, kept by "--state".  Each line of
+// the file is "PRIMARY SECONDARY TIME NAME", the sequence numbers and last
+// written time of the hive.
+typedef struct
+{
+  char*   name;
+  int	  primary, secondary;
+  int64_t time;
+} sweep;
+
+sweep* sweeps;
+int    sweep_count;
+
+
+void read_state( const char* name )
+{
+  FILE* f;
+  char* line = NULL;
+  size_t size = 0;
+  int	primary, secondary, n;
+  int64_t time;
+  sweep* s;
+
+  f = fopen( name, "r" );
+  if (!f)
+    return;
+  while (read_line( f, &line, &size ))
+  {
+    if (sscanf( line, "%d %d %" SCNd64 " %n", &primary, &secondary, &time, &n ) < 3)
+      continue;
+    sweeps = xrealloc( sweeps, (sweep_count + 1) * sizeof(sweep) );
+    s = &sweeps[sweep_count++];
+    s->name = xrealloc( NULL, strlen( line + n ) + 1 );
+    strcpy( s->name, line + n );
+    s->primary = primary;
+    s->secondary = secondary;
+    s->time = time;
+  }
+  free( line );
+  fclose( f );
+}
+
+
+BOOL write_state( const char* name )
+{
+  FILE* f;
+  int	i;
+
+  f = fopen( name, "w" );
+  if (!f)
+    return FALSE;
+  for (i = 0; i < sweep_count; ++i)
+    fprintf( f, "%d %d %" PRId64 " %s\n", sweeps[i].primary,
+	     sweeps[i].secondary, sweeps[i].time, sweeps[i].name );
+  return (fclose( f ) == 0);
+}
+
+
+// Return the last sweep of hive NAME, adding it (with a time of 0) if it's new.
+sweep* find_sweep( const char* name )
+{
+  sweep* s;
+  int	i;
+
+  for (i = 0; i < sweep_count; ++i)
+    if (strcmp( sweeps[i].name, name ) == 0)
+      return &sweeps[i];
+
+  sweeps = xrealloc( sweeps, (sweep_count + 1) * sizeof(sweep) );
+  s = &sweeps[sweep_count++];
+  s->name = xrealloc( NULL, strlen( name ) + 1 );
+  strcpy( s->name, name );
+  s->primary = s->secondary = -1;
+  s->time = 0;
+  return s;
+}
+
+
+// The hives to dump, from "--batch" and "-r" as well as the command line.
+char** hives;
+int    hive_count;
+
+
+void add_hive_name( const char* name )
+{
+  hives = xrealloc( hives, (hive_count + 1) * sizeof(char*) );
+  hives[hive_count] = xrealloc( NULL, strlen( name ) + 1 );
+  strcpy( hives[hive_count++], name );
+}
+
+
+// Add the hives listed in NAME, one per line ("-" is the standard input).
+BOOL read_batch( const char* name )
+{
+  FILE* f;
+  char* line = NULL;
+  size_t size = 0;
+
+  f = (strcmp( name, "-" ) == 0) ? stdin : fopen( name, "r" );
+  if (!f)
+    return FALSE;
+  while (read_line( f, &line, &size ))
+    if (*line)
+      add_hive_name( line );
+  free( line );
+  if (f != stdin)
+    fclose( f );
+  return TRUE;
+}
+
+
+// See if NAME is a hive, rather than one of its logs (which also start with
+// "regf") or anything else.
+BOOL is_hive( const char* name )
+{
+  FILE* f;
+  regf_base_block regf;
+  BOOL	ok;
+
+  f = fopen( name, "rb" );
+  if (!f)
+    return FALSE;
+  ok = (fread( &regf, sizeof(regf), 1, f ) == 1 &&
+	memcmp( regf.signature, "regf", 4 ) == 0 && regf.file_type == 0);
+  fclose( f );
+  return ok;
+}
+
+
+// See if NAME is a directory (but not a link to one).
+BOOL is_dir( const char* name )
+{
+#ifdef _WIN32
+  DWORD attr = GetFileAttributesA( name );
+  return (attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY)
+	  && !(attr & FILE_ATTRIBUTE_REPARSE_POINT));
+#else
+  struct stat st;
+  return (lstat( name, &st ) == 0 && S_ISDIR( st.st_mode ));
+#endif
+}
+
+
+int compare_names( const void* a, const void* b )
+{
+  return strcmp( *(char**)a, *(char**)b );
+}
+
+
+// Add the hives in the directory DIR and all its subdirectories, in order of
+// name.  Links to directories are not followed.
+void find_hives( const char* dir )
+{
+  char** names = NULL;
+  int	 count = 0;
+  char*  path;
+  size_t len = strlen( dir );
+  int	 i;
+#ifdef _WIN32
+  WIN32_FIND_DATAA fd;
+  HANDLE find;
+
+  path = xrealloc( NULL, len + 3 );
+  sprintf( path, "%s\\*", dir );
+  find = FindFirstFileA( path, &fd );
+  free( path );
+  if (find == INVALID_HANDLE_VALUE)
+    return;
+  do
+  {
+    if (strcmp( fd.cFileName, "." ) == 0 || strcmp( fd.cFileName, ".." ) == 0
+	|| (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+      continue;
+    names = xrealloc( names, (count + 1) * sizeof(char*) );
+    names[count] = xrealloc( NULL, strlen( fd.cFileName ) + 1 );
+    strcpy( names[count++], fd.cFileName );
+  } while (FindNextFileA( find, &fd ));
+  FindClose( find );
+#else
+  DIR*	 d;
+  struct dirent* e;
+
+  d = opendir( dir );
+  if (!d)
+    return;
+  while ((e = readdir( d )) != NULL)
+  {
+    if (strcmp( e->d_name, "." ) == 0 || strcmp( e->d_name, ".." ) == 0)
+      continue;
+    names = xrealloc( names, (count + 1) * sizeof(char*) );
+    names[count] = xrealloc( NULL, strlen( e->d_name ) + 1 );
+    strcpy( names[count++], e->d_name );
+  }
+  closedir( d );
+#endif
+
+  qsort( names, count, sizeof(char*), compare_names );
+  for (i = 0; i < count; ++i)
+  {
+    path = xrealloc( NULL, len + strlen( names[i] ) + 2 );
+    sprintf( path, "%s/%s", dir, names[i] );
+    if (is_dir( path ))
+      find_hives( path );
+    else if (is_hive( path ))
+      add_hive_name( path );
+    free( path );
+    free( names[i] );
+  }
+  free( names );
+}
+
+
+// A hive being loaded in the background, while the previous one is walked.
+typedef struct
+{
+  const char* name;
+  regf_hive*       h;
+  BOOL	      ok;
+  stamp       took;
+  thread_t    thread;
+} loader;
+
+
+THREAD_FUNC load_thread( void* arg )
+{
+  loader* l = arg;
+
+  l->ok = open_hive( l->name, l->h, &l->took );
+  return 0;
+}
+
+
+// A subtree to be walked by a worker thread.
+typedef struct
+{
+  regf_key_block* key;
+  regf_bins bins;
+  char*   prefix;			// path of the parent key
+  size_t  prefix_len, prefix_size;
+  BOOL	  properties, driverpackages, shallow;
+  int64_t since;
+  output  out;				// the rendered subtree
+  regf_hive*   release;			// hive to unload once written
+  BOOL	  done;
+} task;
+
+// The buffers of a task are kept for the next one in its place in the queue
+// (so a batch of hives isn't continually allocating), unless it grew beyond
+// this size.
+#define TASK_KEEP 0x100000
+
+
+// Tasks are queued in output order; workers take them from the front and the
+// main thread writes them as they finish, keeping the same order as a serial
+// walk.  The queue is a ring, limiting how far the workers can get ahead.
+typedef struct
+{
+  mutex_t   lock;
+  cond_t    work, done;
+  task*     queue;
+  unsigned  window;
+  unsigned  count, next, written;
+  BOOL	    quit;
+  thread_t* threads;
+  stats     stats;		// of the finished workers
+} pool;
+
+
+THREAD_FUNC worker( void* arg )
+{
+  pool*  p = arg;
+  task*  t;
+  walker w;
+  stats  st;
+
+  memset( &w, 0, sizeof(w) );
+  memset( &st, 0, sizeof(st) );
+  w.group = group_values;
+  set_head( &w );
+  if (show_stats)
+    w.stats = &st;
+  mutex_lock( &p->lock );
+  for (;;)
+  {
+    while (p->next == p->count && !p->quit)
+      cond_wait( &p->work, &p->lock );
+    if (p->next == p->count)
+      break;
+    t = &p->queue[p->next++ % p->window];
+    if (t->key)
+    {
+      mutex_unlock( &p->lock );
+
+      w.out = &t->out;
+      w.bins = t->bins;
+      w.properties = t->properties;
+      w.driverpackages = t->driverpackages;
+      w.shallow = t->shallow;
+      w.since = t->since;
+      path_reserve( &w, 0, t->prefix_len + 1 );
+      memcpy( w.full, t->prefix, t->prefix_len );
+      walk( &w, t->prefix_len, t->key );
+
+      mutex_lock( &p->lock );
+    }
+    t->done = TRUE;
+    cond_broadcast( &p->done );
+  }
+  add_stats( &p->stats, &st );
+  mutex_unlock( &p->lock );
+  free( w.full );
+  free( w.stack );
+  free_names( &w.names );
+  regf_free( &w.rw );
+  return 0;
+}
+
+
+BOOL start_pool( pool* p )
+{
+  int i;
+
+  mutex_init( &p->lock );
+  cond_init( &p->work );
+  cond_init( &p->done );
+  p->window = jobs * 16;
+  p->queue = calloc( p->window, sizeof(task) );
+  p->threads = malloc( jobs * sizeof(thread_t) );
+  p->count = p->next = p->written = 0;
+  p->quit = FALSE;
+  memset( &p->stats, 0, sizeof(p->stats) );
+  if (!p->queue || !p->threads)
+    return FALSE;
+  for (i = 0; i < jobs; ++i)
+    if (!thread_create( &p->threads[i], worker, p ))
+      return FALSE;
+  return TRUE;
+}
+
+
+void stop_pool( pool* p )
+{
+  int i;
+
+  mutex_lock( &p->lock );
+  p->quit = TRUE;
+  cond_broadcast( &p->work );
+  mutex_unlock( &p->lock );
+  for (i = 0; i < jobs; ++i)
+    thread_join( p->threads[i] );
+  for (i = 0; i < (int)p->window; ++i)
+  {
+    free( p->queue[i].out.buf );
+    free( p->queue[i].prefix );
+  }
+  free( p->threads );
+  free( p->queue );
+  cond_destroy( &p->done );
+  cond_destroy( &p->work );
+  mutex_destroy( &p->lock );
+}
+
+
+// Wait for the oldest task to finish and write it.
+void write_task( pool* p, output* out )
+{
+  task* t = &p->queue[p->written % p->window];
+
+  mutex_lock( &p->lock );
+  while (!t->done)
+    cond_wait( &p->done, &p->lock );
+  mutex_unlock( &p->lock );
+
+  out_write( out, t->out.buf, t->out.len );
+  if (t->out.size > TASK_KEEP)
+  {
+    free( t->out.buf );
+    t->out.buf = NULL;
+    t->out.size = 0;
+  }
+  if (t->release)
+  {
+    regf_unload( t->release );
+    free( t->release );
+  }
+  ++p->written;
+}
+
+
+void finish_tasks( pool* p, output* out )
+{
+  while (p->written != p->count)
+    write_task( p, out );
+}
+
+
+task* new_task( pool* p, output* out )
+{
+  task*  t;
+  output keep;
+  char*  prefix;
+  size_t prefix_size;
+
+  while (p->count - p->written == p->window)
+    write_task( p, out );
+
+  t = &p->queue[p->count % p->window];
+  keep = t->out;
+  prefix = t->prefix;
+  prefix_size = t->prefix_size;
+  memset( t, 0, sizeof(task) );
+  t->out.buf = keep.buf;
+  t->out.size = keep.size;
+  t->prefix = prefix;
+  t->prefix_size = prefix_size;
+  return t;
+}
+
+
+void queue_task( pool* p )
+{
+  mutex_lock( &p->lock );
+  ++p->count;
+  cond_broadcast( &p->work );
+  mutex_unlock( &p->lock );
+}
+
+
+// Queue text to go between the subtrees, unloading hive H after it.
+void add_text( pool* p, output* out, const char* text, regf_hive* h )
+{
+  task* t = new_task( p, out );
+
+  out_str( &t->out, text );
+  t->release = h;
+  queue_task( p );
+}
+
+
+void add_hive( pool* p, output* out, const char* name )
+{
+  task* t = new_task( p, out );
+
+  print_hive( &t->out, name );
+  queue_task( p );
+}
+
+
+void add_security( pool* p, output* out, walker* w, const char* name,
+		   regf_key_block* root )
 {
-  int i;
+  task* t = new_task( p, out );
 
-  if (comp)
+  print_security( &t->out, &w->bins, name, root );
+  queue_task( p );
+}
+
+
+// Queue KEY, whose parent's path is in W up to PATH.
+void add_task( pool* p, output* out, walker* w, size_t path,
+	       regf_key_block* key, BOOL shallow )
+{
+  task* t = new_task( p, out );
+
+  t->key = key;
+  t->bins = w->bins;
+  t->prefix_len = path;
+  if (t->prefix_size <= path)
   {
-    unsigned char* uc = (unsigned char*)in;
-    for (i = 0; i < len; ++uc, ++i)
-    {
-      if (*uc >= 32 && *uc < 127)
-	*out++ = *uc;
-      else
-	out += sprintf( out, "<%02X>", *uc );
-    }
+    t->prefix_size = path + 1;
+    t->prefix = xrealloc( t->prefix, t->prefix_size );
   }
-  else
+  memcpy( t->prefix, w->full, t->prefix_len );
+  t->properties = w->properties;
+  t->driverpackages = w->driverpackages;
+  t->shallow = shallow;
+  t->since = w->since;
+  queue_task( p );
+}
+
+
+// Divide the walk of KEY into tasks.  The top two levels are split up, so a
+// large key (like Classes) is shared among the workers as well as the root.
+void split( pool* p, output* out, walker* w, size_t path, regf_key_block* key,
+	    int level )
+{
+  regf_subkey_iter it;
+  regf_key_block* sub;
+  BOOL* leave_key;
+  size_t end;
+
+  regf_first_subkey( &w->bins, key, &it );
+  if (level == 2 || !it.list || !it.list->count)
   {
-    unsigned short* us = (unsigned short*)in;
-    for (i = 0; i < len / 2; ++us, ++i)
-    {
-      if (*us >= 32 && *us < 127)
-	*out++ = (char)*us;
-      else
-	out += sprintf( out, "<%0*X>", (*us < 0x100) ? 2 : 4, *us );
-    }
+    add_task( p, out, w, path, key, FALSE );
+    return;
   }
-  *out = '\0';
-  return out;
+
+  // A key with subkeys is never empty, so the key itself (and its values)
+  // are complete before the subkeys.
+  add_task( p, out, w, path, key, TRUE );
+
+  leave_key = special_key( w, key );
+  end = add_name( w, path, key->name, key->len,
+		  key->flags & REGF_KEY_COMP_NAME );
+  while ((sub = regf_next_subkey( &w->bins, &it )) != NULL)
+    split( p, out, w, end, sub, level + 1 );
+  if (leave_key)
+    *leave_key = FALSE;
 }
 
 
-void print_time( int64_t t, BOOL full, BOOL brackets )
+// A hive kept loaded by "--serve", along with its index.
+typedef struct
 {
-#ifdef _WIN32
-  SYSTEMTIME st;
+  char*  name;
+  regf_hive	 h;
+  BOOL	 loaded;
+  int	 primary, secondary;	// sequence numbers when it was loaded
+  int64_t mtime;		// and when the file was written
+  size_t size;			// and its size
+  BOOL	 indexed;
+  key_index x;
+} served;
+
+
+// Where the time of a file is only to the second, a rewrite within the same
+// second can't be seen, so its sequence numbers are always read again.
+// (Systems with nanoseconds define st_mtime as part of st_mtim.)
+#if defined(_WIN32) || defined(__APPLE__) || defined(st_mtime)
+# define FINE_MTIME 1
 #else
-  time_t secs;
-  struct tm* lt;
+# define FINE_MTIME 0
 #endif
 
-  if (brackets)
-    putchar( '[' );
-
+// Get the time the file NAME was last written (in 100ns units on Windows,
+// nanoseconds where there are, otherwise seconds), and its size.
+BOOL file_stamp( const char* name, int64_t* mtime, size_t* size )
+{
 #ifdef _WIN32
-  FileTimeToSystemTime( (FILETIME*)&t, &st );
-  SystemTimeToTzSpecificLocalTime( NULL, &st, &st );
-  printf( "%u-%02u-%02u %02u:%02u:%02u",
-	  st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond );
+  WIN32_FILE_ATTRIBUTE_DATA fa;
+
+  if (!GetFileAttributesExA( name, GetFileExInfoStandard, &fa ))
+    return FALSE;
+  *mtime = (int64_t)fa.ftLastWriteTime.dwHighDateTime << 32
+	   | fa.ftLastWriteTime.dwLowDateTime;
+  *size = (size_t)((uint64_t)fa.nFileSizeHigh << 32 | fa.nFileSizeLow);
 #else
-  // Translate 100-nanosecond intervals from 1601 to seconds from 1970.
-  secs = (time_t)(t / 10000000) - 11644473600;
-  lt = localtime( &secs );
-  printf( "%d-%02d-%02d %02d:%02d:%02d",
-	  lt->tm_year+1900, lt->tm_mon+1, lt->tm_mday,
-	  lt->tm_hour, lt->tm_min, lt->tm_sec );
+  struct stat st;
+
+  if (stat( name, &st ) != 0)
+    return FALSE;
+# if defined(__APPLE__)
+  *mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000
+	   + st.st_mtimespec.tv_nsec;
+# elif FINE_MTIME
+  *mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+# else
+  *mtime = (int64_t)st.st_mtime;
+# endif
+  *size = (size_t)st.st_size;
 #endif
-  if (full)
-    printf( ".%07d", (int)(t % 10000000) );
+  return TRUE;
+}
 
-  if (brackets)
+
+// Read the sequence numbers of the hive NAME from the file itself (those in
+// memory may have come from the logs).
+BOOL read_sequence( const char* name, int* primary, int* secondary )
+{
+  FILE* f;
+  regf_base_block regf;
+  BOOL	ok;
+
+  f = fopen( name, "rb" );
+  if (!f)
+    return FALSE;
+  ok = (fread( &regf, sizeof(regf), 1, f ) == 1);
+  fclose( f );
+  if (ok)
   {
-    putchar( ']' );
-    putchar( ' ' );
+    *primary = regf.primary_sequence_number;
+    *secondary = regf.secondary_sequence_number;
   }
+  return ok;
 }
 
 
-static char *root, *full;
-
-void walk( char* path, key_block* key )
+// Find the hive NAME in the LIST of COUNT hives, adding it if it's not there,
+// and loading it if it's not loaded or has been written since it was.
+served* serve_hive( served** list, int* count, const char* name, walker* w,
+		    BOOL use_index )
 {
-  static BOOL properties, driverpackages;
-  offsets* val_list;
-  int	size, type;
-  char* data;
-  char* data_block = NULL;
-  BOOL* leave_key = NULL;
-  BOOL	empty_key;
-  int	bintext;
-  int	o, i;
+  served* s;
+  int	primary, secondary;
+  int64_t mtime;
+  size_t size;
+  stamp took;
+  int	i;
 
-  // Add current key name to printed path.
-  *path++ = '/';
-  path = make_name( path, key->name, key->len, key->flags & KEY_COMP_NAME );
-
-  if (only_keys)
+  if (strcmp( name, "-" ) == 0)
   {
-    print_time( key->timestamp, time_full, TRUE );
-    printf( "%s\n", full );
-    empty_key = FALSE;
-    goto children;
+    fputs( "serve: the standard input has the requests.\n", stderr );
+    return NULL;
   }
+  for (i = 0; i < *count; ++i)
+    if (strcmp( (*list)[i].name, name ) == 0)
+      break;
+  if (i == *count)
+  {
+    *list = xrealloc( *list, ++*count * sizeof(served) );
+    s = &(*list)[i];
+    memset( s, 0, sizeof(*s) );
+    s->name = xrealloc( NULL, strlen( name ) + 1 );
+    strcpy( s->name, name );
+  }
+  s = &(*list)[i];
 
-  if (!properties)
+  // The header is only read again if the file looks to have been written
+  // (its size is checked as well, so a file that shrank is never read beyond
+  // its end).  If it can't be read, let the load say why.
+  if (!file_stamp( name, &mtime, &size ))
   {
-    if (key->len == 10 && memcmp( "Properties", key->name, key->len ) == 0)
-    {
-      properties = TRUE;
-      leave_key = &properties;
-    }
+    mtime = -1;
+    size = 0;
   }
-  if (!driverpackages)
+  if (s->loaded && (!FINE_MTIME || s->mtime != mtime || s->size != size))
   {
-    if (key->len == 14 && memcmp( "DriverPackages", key->name, key->len ) == 0)
+    if (mtime != -1 && s->size == size &&
+	read_sequence( name, &primary, &secondary ) &&
+	s->primary == primary && s->secondary == secondary)
+      s->mtime = mtime;
+    else
     {
-      driverpackages = TRUE;
-      leave_key = &driverpackages;
+      if (s->indexed)
+	free_index( &s->x );
+      regf_unload( &s->h );
+      s->loaded = s->indexed = FALSE;
     }
   }
-
-  empty_key = (key->value_count == 0);
-
-  // Print all contained values.
-  val_list = (offsets*)(key->values + root);
-  for (o = 0; o < key->value_count; ++o)
+  if (!s->loaded)
   {
-    value_block* val = (value_block*)(val_list->offsets[o] + root);
-
-    *path = '/';
-    if (val->name_len == 0)
+    if (!open_hive( name, &s->h, &took ))
     {
-      path[1] = '@';
-      path[2] = '\0';
+      report_error( name, &s->h );
+      return NULL;
     }
-    else
+    s->loaded = TRUE;
+    // Without the sequence numbers, it's checked again next time.
+    if (!read_sequence( name, &s->primary, &s->secondary ))
+      mtime = -1;
+    s->mtime = mtime;
+    s->size = size;
+    if (use_index)
     {
-      make_name( path+1, val->name, val->name_len, val->flags & VALUE_COMP_NAME );
+      load_index( name, &s->h, w, regf_root( &w->bins, &s->h ), &s->x );
+      s->indexed = TRUE;
     }
+  }
+  return s;
+}
 
-    if (time_sec || time_full)
-      print_time( key->timestamp, time_full, TRUE );
-
-    size = val->size & 0x7fffffff;
-    if (hex_type)
-      printf( "[%08X:%08X] %s = ", val->value_type, size, full );
-    else
-      printf( "%s [%d:%d] = ", full, val->value_type, size );
 
-    // Data are usually in separate blocks without types, but for small values
-    // MS added optimization where if bit 31 is set data are contained within
-    // the key itself to save space.
-    if (val->size & (1 << 31))
-      data = (char*)&val->offset;
-    else
-    {
-      data = val->offset + root + 4;
-      if (size > 16344 && big_data && *data == 'd' && data[1] == 'b')
-      {
-	list_block* item;
-	offsets* datalist;
-	int left;
-
-	item = (list_block*)(data - 4);
-	datalist = (offsets*)(item->offsets[0] + root);
-	left = size;
-	data = data_block = malloc( size );
-	for (i = 0; i < item->count; ++i)
-	{
-	  memcpy( data, datalist->offsets[i] + root + 4,
-		  (left > 16344) ? 16344 : left );
-	  data += 16344;
-	  left -= 16344;
-	}
-	data = data_block;
-      }
-    }
+// Answer the requests on the standard input, one per line, each being tab-
+// separated fields:
+//
+//	key	HIVE	PATH		the key and its values
+//	tree	HIVE	PATH		the key and all its subkeys
+//	since	TIME	HIVE	PATH	the keys of the tree written after TIME
+//
+// A missing PATH is the root.  Each answer is written as the dump would be,
+// followed by an empty line.  The hives given to start with are loaded
+// straight away; any others the first time they're named.
+int serve( int argc, char* argv[], output* out, BOOL use_index )
+{
+  char* line = NULL;
+  size_t size = 0;
+  served* list = NULL;
+  int	count = 0;
+  served* s;
+  walker w;
+  char* field[4];
+  int	fields;
+  char* name;
+  char* path;
+  regf_key_block* root;
+  regf_key_block* key;
+  size_t end;
+  int64_t since;
+  int	rc = 0;
+  int	i;
 
-    type = val->value_type;
-    if (properties && (type & 0xFFFF0000) == 0xFFFF0000)
-    {
-      switch (type & 0xFFFF)
-      {
-	case DEVPROP_TYPE_INT32:
-	case DEVPROP_TYPE_UINT32:
-	  type = REG_DWORD;
-	  break;
-	case DEVPROP_TYPE_INT64:
-	case DEVPROP_TYPE_UINT64:
-	case DEVPROP_TYPE_FILETIME:
-	  type = REG_QWORD;
-	  break;
-	case DEVPROP_TYPE_STRING:
-	case DEVPROP_TYPE_STRING_INDIRECT:
-	  type = REG_SZ;
-	  break;
-	case DEVPROP_TYPE_STRING_LIST:
-	  type = REG_MULTI_SZ;
-	  break;
-      }
-    }
-    else if (driverpackages)
-      type &= 0xFFFF;
+  memset( &w, 0, sizeof(w) );
+  w.out = out;
+  w.group = group_values;
+  set_head( &w );
+  for (; argc > 1; ++argv, --argc)
+    if (!serve_hive( &list, &count, argv[1], &w, use_index ))
+      rc = 1;
 
-    // See if binary data is text.
-    bintext = 0;
-    if ((type == REG_BINARY || type == REG_NONE) && size >= 8)
+  while (read_line( stdin, &line, &size ))
+  {
+    if (*line == '\0')
+      continue;
+    field[0] = line;
+    for (fields = 1; fields < 4; ++fields)
     {
-      int ascii = 0, min = 8;
-      if (data[1] == 0 && data[3] == 0)
-      {
-	unsigned short* us = (unsigned short*)data;
-	if (*us >= 32 && *us < 127 &&
-	    us[1] >= 32 && us[1] < 127)
-	{
-	  ascii = 2;
-	  for (i = 2; i < size / 2; ++i)
-	    if (us[i] >= 32 && us[i] < 127)
-	      ++ascii;
-	  ascii *= 2;
-	  min = 6;
-	}
-      }
-      else if (*data >= 32 && *data < 127 &&
-	       data[1] >= 32 && data[1] < 127)
-      {
-	ascii = 2;
-	for (i = 2; i < size; ++i)
-	  if (data[i] >= 32 && data[i] < 127)
-	    ++ascii;
-	min = 7;
-      }
-      if (ascii * 8 >= size * min)
-	bintext = (data[1] == 0) ? 16 : 8;
+      field[fields] = strchr( field[fields-1], '\t' );
+      if (!field[fields])
+	break;
+      *field[fields]++ = '\0';
     }
 
-    if (type == REG_DWORD && size == 4)
-    {
-      printf( "0x%X (%d)", *(int*)data, *(int*)data );
-    }
-    else if (properties && size == 1 &&
-	     (type == (0xFFFF0000 | DEVPROP_TYPE_BOOLEAN)))
-    {
-      if (*data == -1)
-	printf( "true" );
-      else if (*data == 0)
-	printf( "false" );
-      else
-	printf( "%02X", *(unsigned char*)data );
-    }
-    else if (properties && size == 2 &&
-	     (type == (0xFFFF0000 | DEVPROP_TYPE_UINT16) ||
-	      type == (0xFFFF0000 | DEVPROP_TYPE_INT16)))
-    {
-      if ((type & 0xFFFF) == DEVPROP_TYPE_UINT16)
-	printf( "0x%X (%u)", *(unsigned short*)data, *(unsigned short*)data );
-      else
-	printf( "0x%X (%d)", *(unsigned short*)data, *(short*)data );
-    }
-    // See if 8 bytes is a 21st century FILETIME.
-    else if (size == 8 &&
-	     (type == REG_QWORD || type == REG_BINARY || type == REG_NONE) &&
-	     *(int64_t*)data >= (int64_t)126227808000000000 &&	// 2001-01-01
-	     *(int64_t*)data < (int64_t)157784544000000000)	// 2101-01-01
-    {
-      print_time( *(int64_t*)data, FALSE, FALSE );
-      if (type == REG_QWORD)
-	printf( " (0x%" PRIX64 "; %" PRId64 ")", *(int64_t*)data, *(int64_t*)data );
-      else
-      {
-	putchar( ' ' );
-	putchar( '(' );
-	for (i = 0; i < size; i++)
-	{
-	  if (i)
-	    putchar( ',' );
-	  printf( "%02X", (unsigned char)data[i] );
-	}
-	putchar( ')' );
-      }
-    }
-    else if (type == REG_QWORD && size == 8)
-    {
-      printf( "0x%" PRIX64 " (%" PRId64 ")", *(int64_t*)data, *(int64_t*)data );
-    }
-    // Strings are stored as Unicode (UTF-16LE).
-    else if (type == REG_SZ ||
-	     type == REG_MULTI_SZ ||
-	     type == REG_EXPAND_SZ ||
-	     type == REG_LINK ||
-	     bintext == 16)
+    since = 0;
+    if (strcmp( field[0], "since" ) == 0 && fields >= 3)
     {
-      unsigned short* us = (unsigned short*)data;
-      size /= 2;
-      if (!bintext)
-	while (size > 0 && us[size-1] == '\0')
-	  --size;
-      for (i = 0; i < size; ++i)
+      since = parse_time( field[1] );
+      if (since == 0)
       {
-	if (us[i] >= 32 && us[i] < 127)
-	  putchar( us[i] );
-	else if (us[i] == '\0' && type == REG_MULTI_SZ && i+1 < size && us[i+1] != '\0')
-	  printf( "<>" );
-	else if (us[i] == '\0' && !all_string && !bintext)
-	{
-	  printf( " <...>" );
-	  break;
-	}
-	else
-	  printf( "<%0*X>", (us[i] < 0x100) ? 2 : 4, us[i] );
+	fprintf( stderr, "serve: \"%s\" is not a time.\n", field[1] );
+	goto answered;
       }
+      name = field[2];
+      path = (fields == 4) ? field[3] : "";
     }
-    else if (bintext /*== 8*/)
+    else if ((strcmp( field[0], "key" ) == 0 ||
+	      strcmp( field[0], "tree" ) == 0) && fields >= 2 && fields <= 3)
     {
-      for (i = 0; i < size; ++i)
-      {
-	if (data[i] >= 32 && data[i] < 127)
-	  putchar( data[i] );
-	else
-	  printf( "<%02X>", (unsigned char)data[i] );
-      }
+      name = field[1];
+      path = (fields == 3) ? field[2] : "";
     }
     else
     {
-      for (i = 0; i < size; ++i)
-      {
-	if (i)
-	  putchar( ',' );
-	printf( "%02X", (unsigned char)data[i] );
-      }
+      fprintf( stderr, "serve: \"%s\" is not a request.\n", field[0] );
+      goto answered;
     }
-    putchar( '\n' );
 
-    if (data_block)
+    s = serve_hive( &list, &count, name, &w, use_index );
+    if (!s)
+      goto answered;
+    root = regf_root( &w.bins, &s->h );
+    w.properties = w.driverpackages = FALSE;
+    w.shallow = (*field[0] == 'k');
+    w.since = since;
+    key = (s->indexed) ? index_key( &w, &s->x, path, &end ) : NULL;
+    if (!key)
+      key = find_key( &w, root, path, &end );
+    if (key)
+      walk( &w, end, key );
+    else
     {
-      free( data_block );
-      data_block = NULL;
+      out_flush( out );
+      fprintf( stderr, "%s: %s: key not found.\n", name, path );
     }
+
+  answered:
+    out_char( out, '\n' );
+    out_flush( out );
   }
 
-children:
-  // For simplicity we can imagine keys as directories in filesystem and values
-  // as files.	Since we already dumped values for this dir we will now iterate
-  // through subdirectories in the same way.
-  if (key->subkeys != -1)
+  for (i = 0; i < count; ++i)
   {
-    list_block* item = (list_block*)(key->subkeys + root);
+    if (list[i].indexed)
+      free_index( &list[i].x );
+    if (list[i].loaded)
+      regf_unload( &list[i].h );
+    free( list[i].name );
+  }
+  free( list );
+  free( line );
+  free( w.full );
+  free( w.stack );
+  free_names( &w.names );
+  regf_free( &w.rw );
+  return rc;
+}
 
-    if (item->count)
-      empty_key = FALSE;
 
-    if (item->block_type[0] == 'l')
-    {
-      int ii = (item->block_type[1] == 'i') ? 1 : 2;
-      for (i = 0; i < item->count; ++i)
-	walk( path, (key_block*)(item->offsets[i*ii] + root) );
-    }
-    else
-    {
-      for (i = 0; i < item->count; ++i)
-      {
-	// In case of too many subkeys this list contains just other lists.
-	list_block* subitem = (list_block*)(item->offsets[i] + root);
-	int j, jj = (subitem->block_type[1] == 'i') ? 1 : 2;
-	for (j = 0; j < subitem->count; ++j)
-	  walk( path, (key_block*)(subitem->offsets[j*jj] + root) );
-      }
-    }
-  }
+// Retrieve the value of an option: the rest of the argument, or the next one.
+char* option_value( int* argc, char*** argv )
+{
+  char* val = (*argv)[1] + 1;
 
-  if (empty_key && !only_values)
+  if (*val == '\0' && *argc > 2)
   {
-    if (time_sec || time_full)
-      print_time( key->timestamp, time_full, TRUE );
-    if (hex_type)
-      printf( "%20c", ' ' );
-    printf( "%s\n", full );
+    ++*argv;
+    --*argc;
+    val = (*argv)[1];
   }
-
-  if (leave_key)
-    *leave_key = FALSE;
+  // Leave the option loop at the end of the value.
+  (*argv)[1] = val + strlen( val ) - 1;
+  return val;
 }
 
 
 int main( int argc, char* argv[] )
 {
-  char	path[0x4000];
-  char* data;
-  base_block* regf;
-  FILE* f;
-  int	size;
+  regf_hive* h;
+  BOOL	ok;
+  loader next;
+  stamp	took;
+  BOOL	loading = FALSE;
+  output out = { NULL, 0, 0, NULL };
+  walker w;
+  pool	p;
+  regf_base_block* regf;
+  regf_key_block* key;
+  regf_key_block* sub;
+  size_t end;
   BOOL	show_hive;
   int	rc = 0;
-  const char* errmsg;
+  int	i, lo, hi;
+  char* val;
+  char* end_val;
+  BOOL	use_index = FALSE;
+  BOOL	indexed;
+  BOOL	diff = FALSE;
+  BOOL	scan = FALSE;
+  BOOL	serving = FALSE;
+  int64_t since = 0;
+  int64_t started = wall_clock();
+  const char* state = NULL;
+  sweep* last;
+  key_index x;
 
   if (argc == 1 || strcmp( argv[1], "/?" ) == 0
 		|| strcmp( argv[1], "-?" ) == 0
@@ -555,30 +4814,190 @@ int main( int argc, char* argv[] )
     printf( "Dump a registry hive as text, one line per value.\n"
 	    "https://github.com/adoxa/regdump\n"
 	    "\n"
-	    "regdump [-hkstTv] HIVE...\n"
+	    "regdump [-ghIkstTv] [-j N] [-o FORMAT] [-p PATH]... [-z METHOD[:LEVEL]] HIVE...\n"
+	    "regdump --diff [-hkstTv] OLD NEW\n"
+	    "regdump --scan [-hstT] HIVE...\n"
+	    "regdump --since TIME | --state FILE [OPTIONS] HIVE...\n"
+	    "regdump --max-data N [OPTIONS] HIVE...\n"
+	    "regdump --batch FILE | -r DIR [OPTIONS] [HIVE...]\n"
+	    "regdump --serve [-ghIkstTv] [-o FORMAT] [HIVE...]\n"
+	    "\n"
+	    "--batch  also dump the hives listed in FILE, one per line\n"
+	    "--diff   write the values added to, removed from or changed in OLD\n"
+	    "--max-data  only write the first N bytes of each value's data\n"
+	    "--raw    don't replay the transaction logs of a dirty hive\n"
+	    "--scan   write every cell in file order, including free (deleted) ones\n"
+	    "--security  write the security descriptors, and which one each key has\n"
+	    "--serve  answer requests (on stdin) for the keys of hives kept loaded\n"
+	    "--since  only dump keys written after TIME (YYYY-MM-DD [HH:MM[:SS]])\n"
+	    "--stats  report counts and times of the dump to stderr\n"
+	    "--state  only dump keys written since the hive was last dumped\n"
 	    "\n"
+	    "-g  group the values under a line of their key\n"
 	    "-h  use hexadecimal for type & size, placed before key\n"
+	    "-I  use an index of the keys (HIVE.idx) for -p, creating it if needed\n"
+	    "-j  walk using N threads\n"
 	    "-k  keys only (implies -t)\n"
+	    "-o  write FORMAT: text (default), ndjson or bin\n"
+	    "-p  only dump the key PATH and its subkeys (may be repeated)\n"
+	    "-r  also dump the hives in DIR and its subdirectories\n"
 	    "-s  include the entire string data (excluding trailing nulls)\n"
 	    "-t  include key timestamp (seconds)\n"
 	    "-T  include key timestamp (full resolution)\n"
 	    "-v  values only\n"
+	    "-z  compress the output with METHOD (gzip or zstd) at LEVEL\n"
 	  );
     return 0;
   }
 
-  while (argc > 1 && *argv[1] == '-')
+  while (argc > 1 && *argv[1] == '-' && argv[1][1] != '\0')
   {
+    if (argv[1][1] == '-')
+    {
+      if (strcmp( argv[1], "--diff" ) == 0)
+	diff = TRUE;
+      else if (strcmp( argv[1], "--scan" ) == 0)
+	scan = TRUE;
+      else if (strcmp( argv[1], "--serve" ) == 0)
+	serving = TRUE;
+      else if (strcmp( argv[1], "--stats" ) == 0)
+	show_stats = TRUE;
+      else if (strcmp( argv[1], "--raw" ) == 0)
+	raw_hive = TRUE;
+      else if (strcmp( argv[1], "--security" ) == 0)
+	show_security = TRUE;
+      else if (strcmp( argv[1], "--since" ) == 0 && argc > 2)
+      {
+	since = parse_time( argv[2] );
+	if (since == 0)
+	{
+	  fprintf( stderr, "since: \"%s\" is not a time.\n", argv[2] );
+	  return 1;
+	}
+	++argv;
+	--argc;
+      }
+      else if (strcmp( argv[1], "--max-data" ) == 0 && argc > 2)
+      {
+	max_data = atoi( argv[2] );
+	if (max_data < 0 || !isdigit( (unsigned char)*argv[2] ))
+	{
+	  fputs( "max-data: expecting a number of bytes.\n", stderr );
+	  return 1;
+	}
+	++argv;
+	--argc;
+      }
+      else if (strcmp( argv[1], "--state" ) == 0 && argc > 2)
+      {
+	state = argv[2];
+	++argv;
+	--argc;
+      }
+      else if (strcmp( argv[1], "--batch" ) == 0 && argc > 2)
+      {
+	if (!read_batch( argv[2] ))
+	{
+	  fprintf( stderr, "batch: unable to read \"%s\".\n", argv[2] );
+	  return 1;
+	}
+	++argv;
+	--argc;
+      }
+      else
+      {
+	fprintf( stderr, "%s: unknown option.\n", argv[1] );
+	return 1;
+      }
+      ++argv;
+      --argc;
+      continue;
+    }
     while (*++argv[1])
     {
       switch (*argv[1])
       {
+	case 'g': group_values = TRUE; break;
 	case 'h': hex_type    = TRUE; break;
+	case 'I': use_index   = TRUE; break;
 	case 's': all_string  = TRUE; break;
 	case 'v': only_values = TRUE; break;
 	case 'k': only_keys   = TRUE; // fall through
 	case 't': time_sec    = TRUE; break;
 	case 'T': time_full   = TRUE; break;
+	case 'j':
+	  jobs = atoi( option_value( &argc, &argv ) );
+	  if (jobs < 1)
+	  {
+	    fputs( "j: expecting a number of threads.\n", stderr );
+	    return 1;
+	  }
+	  break;
+	case 'o':
+	  val = option_value( &argc, &argv );
+	  if (strcmp( val, "text" ) == 0)
+	    format = FMT_TEXT;
+	  else if (strcmp( val, "ndjson" ) == 0)
+	    format = FMT_NDJSON;
+	  else if (strcmp( val, "bin" ) == 0)
+	    format = FMT_BIN;
+	  else
+	  {
+	    fprintf( stderr, "o: unknown format \"%s\".\n", val );
+	    return 1;
+	  }
+	  break;
+	case 'p':
+	  paths = xrealloc( paths, (path_count + 1) * sizeof(char*) );
+	  paths[path_count++] = option_value( &argc, &argv );
+	  break;
+	case 'r':
+	  val = option_value( &argc, &argv );
+	  if (!is_dir( val ))
+	  {
+	    fprintf( stderr, "r: \"%s\" is not a directory.\n", val );
+	    return 1;
+	  }
+	  find_hives( val );
+	  break;
+	case 'z':
+	  val = option_value( &argc, &argv );
+	  end_val = strchr( val, ':' );
+	  if (end_val)
+	  {
+	    *end_val++ = '\0';
+	    compress_level = atoi( end_val );
+	    have_level = TRUE;
+	    if (*end_val == '-')
+	      ++end_val;
+	    if (!isdigit( (unsigned char)*end_val ))
+	    {
+	      fputs( "z: expecting a number for the level.\n", stderr );
+	      return 1;
+	    }
+	  }
+#ifdef HAVE_ZLIB
+	  if (strcmp( val, "gzip" ) == 0)
+	    compression = COMPRESS_GZIP;
+	  else
+#endif
+#ifdef HAVE_ZSTD
+	  if (strcmp( val, "zstd" ) == 0)
+	    compression = COMPRESS_ZSTD;
+	  else
+#endif
+	  {
+	    fprintf( stderr, "z: unknown (or not built) method \"%s\".\n", val );
+	    return 1;
+	  }
+	  level_range( &lo, &hi );
+	  if (have_level && (compress_level < lo || compress_level > hi))
+	  {
+	    fprintf( stderr, "z: the level of %s is from %d to %d.\n",
+		     val, lo, hi );
+	    return 1;
+	  }
+	  break;
 	default:
 	  fprintf( stderr, "%c: unknown option.\n", *argv[1] );
 	  return 1;
@@ -588,67 +5007,277 @@ int main( int argc, char* argv[] )
     --argc;
   }
 
-  full = path;
+  // Put the listed and found hives before those on the command line.
+  if (hive_count)
+  {
+    for (i = 1; i < argc; ++i)
+      add_hive_name( argv[i] );
+    hives = xrealloc( hives, (hive_count + 1) * sizeof(char*) );
+    memmove( hives + 1, hives, hive_count * sizeof(char*) );
+    hives[0] = argv[0];
+    argv = hives;
+    argc = hive_count + 1;
+  }
+
   show_hive = (argc > 2);
+  out.file = stdout;
+  setvbuf( stdout, NULL, _IONBF, 0 );	// we do our own buffering
+  init_simd();
+  if (compression && !start_writer( &zout, stdout ))
+  {
+    fputs( "unable to start compression.\n", stderr );
+    return 1;
+  }
 
-  for (; argc > 1; ++argv, --argc)
+  if (diff)
   {
-    f = fopen( argv[1], "rb" );
-    if (!f)
+    if (argc != 3)
     {
-      perror( argv[1] );
+      fputs( "diff: expecting the old and new hives.\n", stderr );
+      return 1;
+    }
+    if (format != FMT_TEXT)
+    {
+      fputs( "diff: only text can be written.\n", stderr );
+      return 1;
+    }
+    rc = diff_hives( argv[1], argv[2], &out );
+    if (!out_close( &out ))
       rc = 1;
-      continue;
+    return rc;
+  }
+  if (scan)
+  {
+    if (format != FMT_TEXT)
+    {
+      fputs( "scan: only text can be written.\n", stderr );
+      return 1;
+    }
+    for (; argc > 1; ++argv, --argc)
+    {
+      if (show_hive)
+      {
+	out_str( &out, argv[1] );
+	out_mem( &out, "\n\n", 2 );
+      }
+      rc |= scan_hive( argv[1], &out );
+      if (show_hive && argc > 2)
+	out_char( &out, '\n' );
+    }
+    if (!out_close( &out ))
+      rc = 1;
+    return rc;
+  }
+  if (max_data >= 0 && format == FMT_BIN)
+  {
+    fputs( "max-data: binary records are always complete.\n", stderr );
+    return 1;
+  }
+  if (group_values && format != FMT_TEXT)
+  {
+    fputs( "g: only text can be grouped.\n", stderr );
+    return 1;
+  }
+  if (show_security && format == FMT_BIN)
+  {
+    fputs( "security: only text or ndjson can be written.\n", stderr );
+    return 1;
+  }
+  if (serving)
+  {
+    if (show_security)
+    {
+      fputs( "serve: security descriptors can't be served.\n", stderr );
+      return 1;
+    }
+    if (format == FMT_BIN || compression)
+    {
+      fputs( "serve: only uncompressed text or ndjson can be served.\n", stderr );
+      return 1;
+    }
+    rc = serve( argc, argv, &out, use_index );
+    if (!out_close( &out ))
+      rc = 1;
+    return rc;
+  }
+  if (state)
+    read_state( state );
+  memset( &w, 0, sizeof(w) );
+  w.out = &out;
+  w.group = group_values;
+  set_head( &w );
+  if (show_stats)
+    w.stats = &totals;
+
+  if (jobs > 1 && !start_pool( &p ))
+  {
+    fputs( "unable to start threads.\n", stderr );
+    return 1;
+  }
+
+  for (; argc > 1; ++argv, --argc)
+  {
+    if (loading)
+    {
+      thread_join( next.thread );
+      h = next.h;
+      ok = next.ok;
+      took = next.took;
+      loading = FALSE;
+    }
+    else
+    {
+      h = malloc( sizeof(regf_hive) );
+      ok = (h && open_hive( argv[1], h, &took ));
+    }
+
+    // Load the next hive while this one is walked.
+    if (argc > 2)
+    {
+      next.name = argv[2];
+      next.h = malloc( sizeof(regf_hive) );
+      loading = (next.h && thread_create( &next.thread, load_thread, &next ));
+      if (!loading)
+	free( next.h );
     }
 
-    if (fread( path, 4, 1, f ) != 1 || memcmp( path, "regf", 4 ) != 0)
+    if (!ok)
     {
-      errmsg = "invalid file ('regf' signature not found)";
-    error:
-      fprintf( stderr, "%s: %s.\n", argv[1], errmsg );
-      fclose( f );
+      if (jobs > 1)
+	finish_tasks( &p, &out );
+      out_flush( &out );
+      if (h)
+	report_error( argv[1], h );
+      else
+	fprintf( stderr, "%s: insufficient memory.\n", argv[1] );
+      free( h );
       rc = 1;
       continue;
     }
 
-    fseek( f, 0x1000, SEEK_SET );
-    if (fread( path, 4, 1, f ) != 1 || memcmp( path, "hbin", 4 ) != 0)
+    totals.bytes_read += h->size;
+    totals.wall[PHASE_LOAD] += took.wall;
+    totals.cpu[PHASE_LOAD] += took.cpu;
+    regf = (regf_base_block*)h->data;
+    w.shallow = FALSE;
+    w.since = since;
+    if (state)
     {
-      errmsg = "invalid file ('hbin' signature not found)";
-      goto error;
+      // Nothing has been written if the hive is the same as the last sweep.
+      last = find_sweep( argv[1] );
+      if (last->primary == regf->primary_sequence_number &&
+	  last->secondary == regf->secondary_sequence_number &&
+	  memcmp( &last->time, regf->last_written_timestamp, 8 ) == 0)
+      {
+	regf_unload( h );
+	free( h );
+	continue;
+      }
+      if (last->time)
+	w.since = last->time;
+      last->primary = regf->primary_sequence_number;
+      last->secondary = regf->secondary_sequence_number;
+      memcpy( &last->time, regf->last_written_timestamp, 8 );
     }
 
-    fseek( f, 0, SEEK_END );
-    size = ftell( f );
-    data = malloc( size );
-    if (!data)
+    // We just skip header and start walking root key tree.
+    key = regf_root( &w.bins, h );
+    // The machine-readable formats always have a record for the hive.
+    if (format != FMT_TEXT)
     {
-      errmsg = "insufficient memory";
-      goto error;
+      if (jobs > 1)
+	add_hive( &p, &out, argv[1] );
+      else
+	print_hive( &out, argv[1] );
     }
-
-    rewind( f );
-    if (fread( data, size, 1, f ) != 1)
+    else if (show_hive)
+    {
+      if (jobs > 1)
+      {
+	add_text( &p, &out, argv[1], NULL );
+	add_text( &p, &out, "\n\n", NULL );
+      }
+      else
+      {
+	out_str( &out, argv[1] );
+	out_mem( &out, "\n\n", 2 );
+      }
+    }
+    if (show_security)
     {
-      free( data );
-      errmsg = "read error";
-      goto error;
+      if (jobs > 1)
+	add_security( &p, &out, &w, argv[1], key );
+      else
+	print_security( &out, &w.bins, argv[1], key );
     }
-    fclose( f );
+    // There's nowhere to keep the index of the standard input.
+    indexed = (use_index && path_count && strcmp( argv[1], "-" ) != 0);
+    if (indexed)
+      load_index( argv[1], h, &w, key, &x );
+    for (i = 0; i < (path_count ? path_count : 1); ++i)
+    {
+      w.properties = w.driverpackages = FALSE;
+      sub = key;
+      end = 0;
+      // Search the hive if the index doesn't have it (which would only be if
+      // it's not there, or the index is out of date and somehow not detected).
+      if (path_count)
+      {
+	sub = (indexed) ? index_key( &w, &x, paths[i], &end ) : NULL;
+	if (!sub)
+	  sub = find_key( &w, key, paths[i], &end );
+      }
+      if (!sub)
+      {
+	if (jobs > 1)
+	  finish_tasks( &p, &out );
+	out_flush( &out );
+	fprintf( stderr, "%s: %s: key not found.\n", argv[1], paths[i] );
+	rc = 1;
+	continue;
+      }
+      if (jobs > 1)
+	split( &p, &out, &w, end, sub, 0 );
+      else
+	walk( &w, end, sub );
+    }
+    if (indexed)
+      free_index( &x );
+    if (jobs > 1)
+    {
+      // Hives are queued one after the other, so several can be walked at
+      // once; each is unloaded after its last subtree is written.
+      add_text( &p, &out,
+		(show_hive && argc > 2 && format == FMT_TEXT) ? "\n" : "", h );
+    }
+    else
+    {
+      regf_unload( h );
+      free( h );
 
-    regf = (base_block*)data;
-    big_data = (regf->major_version > 1 || regf->minor_version > 3);
+      if (show_hive && argc > 2 && format == FMT_TEXT)
+	out_char( &out, '\n' );
 
-    if (show_hive)
-      printf( "%s\n\n", argv[1] );
+      // Keep the output in step with any error messages.
+      out_flush( &out );
+    }
+  }
 
-    // We just skip header and start walking root key tree.
-    root = data + 0x1000;
-    walk( path, (key_block*)(regf->root_cell_offset + root) );
-    free( data );
+  if (jobs > 1)
+  {
+    finish_tasks( &p, &out );
+    stop_pool( &p );
+    add_stats( &totals, &p.stats );
+  }
+  if (!out_close( &out ))
+    rc = 1;
+  if (show_stats)
+    print_stats( &totals, wall_clock() - started, cpu_clock( TRUE ) );
 
-    if (show_hive && argc > 2)
-      putchar( '\n' );
+  if (state && !write_state( state ))
+  {
+    fprintf( stderr, "%s: unable to write the state.\n", state );
+    rc = 1;
   }
 
   return rc;
@@ -0,0 +1,885 @@
+/*
+  regf.c - Read a registry hive.
+
+  Loading a hive, replaying its transaction logs, and walking its keys with a
+  visitor; see regf.h.
+*/
+
+// Let a 32-bit build still map a hive of more than 2GiB.
+#define _FILE_OFFSET_BITS 64
+
+#ifdef _WIN32
+# define _CRT_SECURE_NO_WARNINGS
+# define WIN32_LEAN_AND_MEAN
+# include <windows.h>
+# include "regf.h"
+# include <io.h>
+# include <fcntl.h>
+#else
+# include "regf.h"
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+typedef int BOOL;
+# define TRUE 1
+# define FALSE 0
+#endif
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+
+// Render a name in UTF-8, with unpaired surrogates replaced by U+FFFD.
+// OUT needs room for twice a compressed LEN, or three halves of a wide one.
+char* regf_utf8( char* out, char* in, int len, int comp )
+{
+  unsigned char* uc = (unsigned char*)in;
+  unsigned short* us = (unsigned short*)in;
+  unsigned c;
+  int	i, n;
+
+  n = comp ? len : len / 2;
+  for (i = 0; i < n; ++i)
+  {
+    c = comp ? uc[i] : us[i];
+    if (c >= 0xD800 && c < 0xE000)
+    {
+      if (c < 0xDC00 && i + 1 < n && us[i+1] >= 0xDC00 && us[i+1] < 0xE000)
+	c = 0x10000 + ((c - 0xD800) << 10) + (us[++i] - 0xDC00);
+      else
+	c = 0xFFFD;
+    }
+    if (c < 0x80)
+      *out++ = c;
+    else if (c < 0x800)
+    {
+      *out++ = 0xC0 | (c >> 6);
+      *out++ = 0x80 | (c & 63);
+    }
+    else if (c < 0x10000)
+    {
+      *out++ = 0xE0 | (c >> 12);
+      *out++ = 0x80 | ((c >> 6) & 63);
+      *out++ = 0x80 | (c & 63);
+    }
+    else
+    {
+      *out++ = 0xF0 | (c >> 18);
+      *out++ = 0x80 | ((c >> 12) & 63);
+      *out++ = 0x80 | ((c >> 6) & 63);
+      *out++ = 0x80 | (c & 63);
+    }
+  }
+  *out = '\0';
+  return out;
+}
+
+
+// Return the key at OFF, or NULL if it (or its name) isn't all there.
+regf_key_block* regf_key( const regf_bins* b, int off )
+{
+  regf_key_block* key = regf_cell( b, off, offsetof(regf_key_block, name) );
+
+  if (!key || key->block_type[0] != 'n' || key->block_type[1] != 'k' ||
+      key->len < 0 ||
+      !regf_cell( b, off, offsetof(regf_key_block, name) + key->len ))
+    return NULL;
+  return key;
+}
+
+
+// Return the value at OFF, or NULL if it (or its name) isn't all there.
+regf_value_block* regf_value( const regf_bins* b, int off )
+{
+  regf_value_block* val = regf_cell( b, off, offsetof(regf_value_block, name) );
+
+  if (!val || val->block_type[0] != 'v' || val->block_type[1] != 'k' ||
+      val->name_len < 0 ||
+      !regf_cell( b, off, offsetof(regf_value_block, name) + val->name_len ))
+    return NULL;
+  return val;
+}
+
+
+// Return the value list of KEY, or NULL if it has none (or it's not all there).
+regf_offsets* regf_values( const regf_bins* b, regf_key_block* key )
+{
+  if (key->value_count <= 0)
+    return NULL;
+  return regf_cell( b, key->values, 4 + (uint64_t)key->value_count * 4 );
+}
+
+
+// Return the security cell at OFF, or NULL if it (or its descriptor) isn't all
+// there.
+regf_security_block* regf_security( const regf_bins* b, int off )
+{
+  const size_t head = offsetof(regf_security_block, descriptor);
+  regf_security_block* sk = regf_cell( b, off, head );
+
+  if (!sk || sk->block_type[0] != 's' || sk->block_type[1] != 'k' ||
+      sk->size < 0 || !regf_cell( b, off, head + (uint64_t)sk->size ))
+    return NULL;
+  return sk;
+}
+
+
+// Return the subkey list at OFF, or NULL if it isn't one (or isn't all there).
+regf_list_block* regf_subkey_list( const regf_bins* b, int off )
+{
+  regf_list_block* list;
+
+  list = regf_cell( b, off, offsetof(regf_list_block, offsets) );
+
+  if (!list || list->count < 0)
+    return NULL;
+  if (list->block_type[0] == 'l' &&
+      (list->block_type[1] == 'f' || list->block_type[1] == 'h'))
+    return regf_cell( b, off, 8 + (uint64_t)list->count * 8 );
+  if ((list->block_type[0] == 'l' || list->block_type[0] == 'r') &&
+      list->block_type[1] == 'i')
+    return regf_cell( b, off, 8 + (uint64_t)list->count * 4 );
+  return NULL;
+}
+
+
+void regf_first_subkey( const regf_bins* b, regf_key_block* key,
+			regf_subkey_iter* it )
+{
+  it->list = NULL;
+  it->sub = NULL;
+  it->i = it->j = 0;
+  it->bad = 0;
+  if (key->subkeys != -1)
+  {
+    it->list = regf_subkey_list( b, key->subkeys );
+    if (!it->list)
+      ++it->bad;
+  }
+}
+
+
+// Return the next subkey in order, or NULL when there are no more.  Subkeys
+// (and lists) that aren't all there are skipped, counting them in BAD.
+regf_key_block* regf_next_subkey( const regf_bins* b, regf_subkey_iter* it )
+{
+  regf_list_block* item = it->list;
+  regf_key_block* key;
+  int	ii, jj;
+
+  if (!item)
+    return NULL;
+
+  if (item->block_type[0] == 'l')
+  {
+    ii = (item->block_type[1] == 'i') ? 1 : 2;
+    while (it->i < item->count)
+    {
+      key = regf_key( b, item->offsets[it->i++ * ii] );
+      if (it->i < item->count)
+	regf_prefetch( b, item->offsets[it->i * ii] );
+      if (key)
+	return key;
+      ++it->bad;
+    }
+  }
+  else
+  {
+    // In case of too many subkeys this list contains just other lists.
+    while (it->i < item->count)
+    {
+      regf_list_block* subitem = it->sub;
+      if (!subitem)
+      {
+	subitem = regf_subkey_list( b, item->offsets[it->i] );
+	if (!subitem || subitem->block_type[0] == 'r')
+	{
+	  ++it->bad;
+	  ++it->i;
+	  continue;
+	}
+	it->sub = subitem;
+      }
+      jj = (subitem->block_type[1] == 'i') ? 1 : 2;
+      while (it->j < subitem->count)
+      {
+	key = regf_key( b, subitem->offsets[it->j++ * jj] );
+	if (it->j < subitem->count)
+	  regf_prefetch( b, subitem->offsets[it->j * jj] );
+	if (key)
+	  return key;
+	++it->bad;
+      }
+      ++it->i;
+      it->j = 0;
+      it->sub = NULL;
+    }
+  }
+  return NULL;
+}
+
+
+int regf_segment_count( regf_value_data* vd )
+{
+  return vd->segs ? (vd->size + REGF_DB_SEGMENT - 1) / REGF_DB_SEGMENT : 1;
+}
+
+
+// Return segment N of the data, setting LEN to its size.  Segments are an
+// even size, so UTF-16 characters are never split between them.
+char* regf_segment( regf_value_data* vd, int n, int* len )
+{
+  if (!vd->segs)
+  {
+    *len = vd->size;
+    return vd->data;
+  }
+  *len = vd->size - n * REGF_DB_SEGMENT;
+  if (*len > REGF_DB_SEGMENT)
+    *len = REGF_DB_SEGMENT;
+  return (unsigned)vd->segs[n] + vd->root + 4;
+}
+
+
+// Find the data of a value.  Data are usually in separate blocks without
+// types, but for small values MS added optimization where if bit 31 is set
+// data are contained within the key itself to save space.  Returns FALSE
+// (with no data) if the data isn't all there.
+BOOL regf_data( const regf_bins* b, regf_value_block* val, regf_value_data* vd )
+{
+  regf_list_block* item;
+  regf_offsets* segs;
+  char* data;
+  int	i, n;
+
+  vd->segs = NULL;
+  vd->size = val->size & 0x7fffffff;
+  vd->root = b->root;
+  vd->data = (char*)&val->offset;
+  if (val->size & (1 << 31))
+  {
+    if (vd->size <= 4)
+      return TRUE;
+    vd->size = 0;
+    return FALSE;
+  }
+
+  item = regf_cell( b, val->offset, offsetof(regf_list_block, offsets) + 4 );
+  if (vd->size > REGF_DB_SEGMENT && b->big_data && item &&
+      item->block_type[0] == 'd' && item->block_type[1] == 'b')
+  {
+    // Big data is printed straight from its segments, all of which must be
+    // there (the last need only be as big as what's left).
+    n = (item->count < 0) ? 0 : item->count;
+    if (vd->size > n * REGF_DB_SEGMENT)
+      vd->size = n * REGF_DB_SEGMENT;
+    n = (vd->size + REGF_DB_SEGMENT - 1) / REGF_DB_SEGMENT;
+    segs = regf_cell( b, item->offsets[0], 4 + (uint64_t)n * 4 );
+    for (i = 0; segs && i < n; ++i)
+      if (!regf_cell( b, segs->offsets[i], 4 + ((i < n - 1) ? REGF_DB_SEGMENT
+				      : vd->size - i * REGF_DB_SEGMENT) ))
+	segs = NULL;
+    if (!segs)
+    {
+      vd->size = 0;
+      return FALSE;
+    }
+    vd->segs = segs->offsets;
+    if (vd->size > 0)
+      vd->data = (unsigned)vd->segs[0] + b->root + 4;
+    return TRUE;
+  }
+
+  data = regf_cell( b, val->offset, 4 + (uint64_t)vd->size );
+  if (!data)
+  {
+    vd->size = 0;
+    return FALSE;
+  }
+  vd->data = data + 4;
+  return TRUE;
+}
+
+
+// Map the hive straight into memory, so the walk only touches what it needs.
+// The mapping is private, so writing to it (replaying the logs) only changes
+// the copy.  Returns FALSE if the file cannot be mapped (the caller will read
+// it instead).
+static BOOL map_hive( const char* name, regf_hive* h )
+{
+#ifdef _WIN32
+  HANDLE file;
+  LARGE_INTEGER size;
+
+  file = CreateFileA( name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		      NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL );
+  if (file == INVALID_HANDLE_VALUE)
+    return FALSE;
+  if (GetFileType( file ) != FILE_TYPE_DISK ||
+      !GetFileSizeEx( file, &size ) || size.QuadPart == 0 ||
+      (uint64_t)size.QuadPart > (size_t)-1)
+  {
+    CloseHandle( file );
+    return FALSE;
+  }
+  h->map = CreateFileMappingA( file, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+  CloseHandle( file );
+  if (!h->map)
+    return FALSE;
+  h->data = MapViewOfFile( h->map, FILE_MAP_COPY, 0, 0, 0 );
+  if (!h->data)
+  {
+    CloseHandle( h->map );
+    return FALSE;
+  }
+  h->size = (size_t)size.QuadPart;
+#else
+  struct stat st;
+  void* data;
+  int	fd;
+
+  fd = open( name, O_RDONLY );
+  if (fd < 0)
+    return FALSE;
+  if (fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) || st.st_size == 0 ||
+      (uint64_t)st.st_size > (size_t)-1)
+  {
+    close( fd );
+    return FALSE;
+  }
+  data = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if (data == MAP_FAILED)
+    return FALSE;
+  // Cells are scattered, so get the kernel reading ahead of the walk.
+  madvise( data, st.st_size, MADV_WILLNEED );
+  h->data = data;
+  h->size = st.st_size;
+#endif
+  h->mapped = TRUE;
+  return TRUE;
+}
+
+
+void regf_unload( regf_hive* h )
+{
+  if (!h->mapped)
+    free( h->data );
+  else
+  {
+#ifdef _WIN32
+    UnmapViewOfFile( h->data );
+    CloseHandle( h->map );
+#else
+    munmap( h->data, h->size );
+#endif
+  }
+  h->data = NULL;
+}
+
+
+// Read a hive from a stream, which need not be seekable (a pipe).  The base
+// block gives the size of the hive bins, so the buffer is usually allocated
+// just once (with a byte to spare, to see the end); it's not trusted, though,
+// so no more than STREAM_GUESS is taken on its word, and the buffer still
+// grows if there's more.
+#define STREAM_GUESS 0x400000
+
+static BOOL read_stream( FILE* f, regf_hive* h )
+{
+  char*  data;
+  char*  grown;
+  size_t size, alloc, n;
+  uint32_t bins;
+
+  alloc = 0x1000;
+  data = malloc( alloc );
+  if (!data)
+  {
+    h->errmsg = "insufficient memory";
+    return FALSE;
+  }
+  size = 0;
+  for (;;)
+  {
+    if (size == alloc)
+    {
+      bins = (uint32_t)((regf_base_block*)data)->hive_bins_data_size;
+      // Cell offsets are 32-bit, so the bins can't go past 4GiB.
+      if (alloc == 0x1000 && memcmp( data, "regf", 4 ) == 0
+	  && bins <= 0xFFFFFFFF - 0x1000)
+	alloc += ((bins < STREAM_GUESS) ? bins : STREAM_GUESS) + 1;
+      else if (alloc <= (size_t)-1 / 2)
+	alloc *= 2;
+      else
+	alloc = 0;		// there's no doubling it
+      grown = (alloc) ? realloc( data, alloc ) : NULL;
+      if (!grown)
+      {
+	free( data );
+	h->errmsg = "insufficient memory";
+	return FALSE;
+      }
+      data = grown;
+    }
+    n = fread( data + size, 1, alloc - size, f );
+    if (n == 0)
+      break;
+    size += n;
+  }
+  if (ferror( f ))
+  {
+    free( data );
+    h->errmsg = "read error";
+    return FALSE;
+  }
+
+  h->data = data;
+  h->size = size;
+  h->mapped = FALSE;
+  return TRUE;
+}
+
+
+// Load a file, mapping it if possible, otherwise reading all of it.  A name
+// of "-" is the standard input.
+static BOOL load_file( const char* name, regf_hive* h )
+{
+  FILE* f;
+  BOOL	ok;
+
+  h->errmsg = NULL;
+  if (strcmp( name, "-" ) == 0)
+  {
+#ifdef _WIN32
+    _setmode( _fileno( stdin ), _O_BINARY );
+#endif
+    return read_stream( stdin, h );
+  }
+  if (map_hive( name, h ))
+    return TRUE;
+
+  f = fopen( name, "rb" );
+  if (!f)
+  {
+    h->error = errno;
+    return FALSE;
+  }
+  ok = read_stream( f, h );
+  fclose( f );
+  return ok;
+}
+
+
+// Transaction logs are replayed over the hive when it's dirty (the sequence
+// numbers differ).  Only the new format (Windows 8.1 and later) is supported:
+// after a copy of the base block come entries of the pages to be written.
+// The hive is mapped copy-on-write, so only those pages get copied, and
+// neither file is ever written.
+typedef struct
+{
+  char signature[4];		// "HvLE"
+  int  size;			// of the whole entry
+  int  flags;
+  int  sequence_number;
+  int  hive_bins_data_size;
+  int  dirty_pages_count;
+  int  hash1[2];		// avoid alignment issues with int64_t
+  int  hash2[2];
+  int  dirty_pages[1];		// offset and size of each page, then the pages
+} log_entry;
+
+#define LOG_ENTRY_HEADER 40
+
+
+#define ROTL( x, n ) (((x) << (n)) | ((x) >> (32 - (n))))
+
+// The hash of the log entries.
+static uint64_t marvin32( const unsigned char* data, size_t len )
+{
+  unsigned lo = 0x7A4E55C5, hi = 0x82EF4D88, v;
+
+#define MARVIN_BLOCK \
+  hi ^= lo; lo = ROTL( lo, 20 ); \
+  lo += hi; hi = ROTL( hi, 9 );  \
+  hi ^= lo; lo = ROTL( lo, 27 ); \
+  lo += hi; hi = ROTL( hi, 19 )
+
+  for (; len >= 4; data += 4, len -= 4)
+  {
+    memcpy( &v, data, 4 );
+    lo += v;
+    MARVIN_BLOCK;
+  }
+  switch (len)
+  {
+    case 0: lo += 0x80; break;
+    case 1: lo += 0x8000 | data[0]; break;
+    case 2: lo += 0x800000 | data[0] | (data[1] << 8); break;
+    case 3: lo += 0x80000000 | data[0] | (data[1] << 8) | (data[2] << 16); break;
+  }
+  MARVIN_BLOCK;
+  MARVIN_BLOCK;
+  return ((uint64_t)hi << 32) | lo;
+}
+
+
+// Collect the entries of a log into LIST, stopping at the first one that isn't
+// valid (the rest of the log is old).  Returns how many.
+static int log_entries( regf_hive* log, log_entry*** list )
+{
+  regf_base_block* regf = (regf_base_block*)log->data;
+  log_entry* e;
+  log_entry** more;
+  unsigned* p;
+  unsigned sum, pages;
+  uint64_t hash;
+  uint32_t size, dirty;
+  size_t off, len;
+  int	count = 0;
+  uint32_t i;
+
+  *list = NULL;
+  if (log->size < 512 || memcmp( regf->signature, "regf", 4 ) != 0)
+    return 0;
+  // The base block has an XOR checksum.
+  for (sum = 0, p = (unsigned*)log->data, i = 0; i < 127; ++i)
+    sum ^= p[i];
+  if (sum == 0)
+    sum = 1;
+  else if (sum == 0xFFFFFFFF)
+    sum = 0xFFFFFFFE;
+  if (sum != p[127])
+    return 0;
+
+  for (off = 512; off + LOG_ENTRY_HEADER <= log->size; off += size)
+  {
+    e = (log_entry*)(log->data + off);
+    if (memcmp( e->signature, "HvLE", 4 ) != 0 ||
+	e->size < LOG_ENTRY_HEADER || e->dirty_pages_count < 0)
+      break;
+    // Both are known to be positive, so the rest is done unsigned.
+    size = (uint32_t)e->size;
+    dirty = (uint32_t)e->dirty_pages_count;
+    if (size % 512 != 0 || size > log->size - off ||
+	dirty > (size - LOG_ENTRY_HEADER) / 8)
+      break;
+    hash = marvin32( (unsigned char*)e, 32 );
+    if (memcmp( &hash, e->hash2, 8 ) != 0)
+      break;
+    hash = marvin32( (unsigned char*)e + LOG_ENTRY_HEADER,
+		     size - LOG_ENTRY_HEADER );
+    if (memcmp( &hash, e->hash1, 8 ) != 0)
+      break;
+    // Make sure the pages are all there.
+    len = LOG_ENTRY_HEADER + (size_t)dirty * 8;
+    for (i = 0; i < dirty; ++i)
+    {
+      pages = (unsigned)e->dirty_pages[i*2+1];
+      if (pages > size - len)
+	break;
+      len += pages;
+    }
+    if (i < dirty)
+      break;
+
+    more = realloc( *list, (count + 1) * sizeof(log_entry*) );
+    if (!more)
+      break;
+    *list = more;
+    (*list)[count++] = e;
+  }
+  return count;
+}
+
+
+// Write the pages of a log entry over the hive.  Returns FALSE if they don't
+// fit (when it has grown beyond what's been mapped, it's read into memory).
+static BOOL apply_entry( regf_hive* h, log_entry* e )
+{
+  size_t size = 0x1000 + (unsigned)e->hive_bins_data_size;
+  unsigned off, len;
+  char* data;
+  int	i;
+
+  if (size > h->size)
+  {
+    data = malloc( size );
+    if (!data)
+      return FALSE;
+    memcpy( data, h->data, h->size );
+    memset( data + h->size, 0, size - h->size );
+    regf_unload( h );
+    h->data = data;
+    h->size = size;
+    h->mapped = FALSE;
+  }
+
+  data = (char*)&e->dirty_pages[e->dirty_pages_count * 2];
+  for (i = 0; i < e->dirty_pages_count; ++i)
+  {
+    off = (unsigned)e->dirty_pages[i*2];
+    len = (unsigned)e->dirty_pages[i*2+1];
+    if (off > h->size - 0x1000 || len > h->size - 0x1000 - off)
+      return FALSE;
+    memcpy( h->data + 0x1000 + off, data, len );
+    data += len;
+  }
+  return TRUE;
+}
+
+
+// Replay the logs ("HIVE.LOG1" and "HIVE.LOG2") of a dirty hive, applying the
+// entries in sequence from the secondary sequence number (the last complete
+// write of the hive).
+static void replay_logs( const char* name, regf_hive* h )
+{
+  static const char* const ext[2] = { ".LOG1", ".LOG2" };
+  char* file;
+  regf_hive	logs[2];
+  log_entry** list[2];
+  int	count[2];
+  log_entry* e;
+  regf_base_block* regf = (regf_base_block*)h->data;
+  int	seq;
+  int	i, j;
+
+  if (regf->primary_sequence_number == regf->secondary_sequence_number)
+    return;
+
+  file = malloc( strlen( name ) + 6 );
+  if (!file)
+    return;
+  for (i = 0; i < 2; ++i)
+  {
+    strcpy( file, name );
+    strcat( file, ext[i] );
+    count[i] = 0;
+    list[i] = NULL;
+    if (load_file( file, &logs[i] ))
+      count[i] = log_entries( &logs[i], &list[i] );
+    else
+      logs[i].data = NULL;
+  }
+  free( file );
+
+  for (seq = regf->secondary_sequence_number;; ++seq)
+  {
+    e = NULL;
+    for (i = 0; i < 2 && !e; ++i)
+      for (j = 0; j < count[i]; ++j)
+	if (list[i][j]->sequence_number == seq)
+	{
+	  e = list[i][j];
+	  break;
+	}
+    if (!e || !apply_entry( h, e ))
+      break;
+    // The hive may have been moved.
+    regf = (regf_base_block*)h->data;
+    regf->hive_bins_data_size = e->hive_bins_data_size;
+    regf->primary_sequence_number = regf->secondary_sequence_number = seq + 1;
+  }
+
+  for (i = 0; i < 2; ++i)
+  {
+    free( list[i] );
+    if (logs[i].data)
+      regf_unload( &logs[i] );
+  }
+}
+
+
+// Load a hive, returning FALSE if it is invalid (with the reason in ERRMSG,
+// or ERROR if that's NULL).  REPLAY the transaction logs if it's dirty.
+BOOL regf_load( const char* name, regf_hive* h, BOOL replay )
+{
+  regf_bins b;
+
+  if (!load_file( name, h ))
+    return FALSE;
+
+  if (h->size < 4 || memcmp( h->data, "regf", 4 ) != 0)
+    h->errmsg = "invalid file ('regf' signature not found)";
+  else if (h->size < 0x1004 || memcmp( h->data + 0x1000, "hbin", 4 ) != 0)
+    h->errmsg = "invalid file ('hbin' signature not found)";
+  else
+  {
+    if (replay && strcmp( name, "-" ) != 0)
+      replay_logs( name, h );
+    if (regf_root( &b, h ))
+      return TRUE;
+    h->errmsg = "invalid file (root key not found)";
+  }
+  regf_unload( h );
+  return FALSE;
+}
+
+
+// Set B to the bins of hive H, returning its root key (which a loaded hive is
+// known to have).
+regf_key_block* regf_root( regf_bins* b, regf_hive* h )
+{
+  regf_base_block* regf = (regf_base_block*)h->data;
+
+  b->root = h->data + 0x1000;
+  b->size = h->size - 0x1000;
+  b->big_data = (regf->major_version > 1 || regf->minor_version > 3);
+  return regf_key( b, regf->root_cell_offset );
+}
+
+
+// Prepare RW to walk hive H, returning its root key.
+regf_key_block* regf_start( regf_walker* rw, regf_hive* h )
+{
+  memset( rw, 0, sizeof(*rw) );
+  return regf_root( &rw->bins, h );
+}
+
+
+// Make room for more keys on the stack of RW, returning FALSE if there's no
+// memory for them.
+static BOOL grow_stack( regf_walker* rw )
+{
+  int	size = (rw->stack_size) ? rw->stack_size * 2 : 32;
+  regf_frame* stack = realloc( rw->stack, size * sizeof(regf_frame) );
+
+  if (!stack)
+    return FALSE;
+  rw->stack = stack;
+  rw->stack_size = size;
+  return TRUE;
+}
+
+
+// Walk KEY and all its subkeys, calling the visitor's functions.  Rather than
+// recursing, the keys being walked are kept on a stack, which guards against
+// keys nested too deeply or looping back on themselves.
+void regf_walk( regf_walker* rw, regf_key_block* key, const regf_visitor* v,
+		void* ctx )
+{
+  regf_frame* f = NULL;
+  regf_offsets* val_list;
+  regf_value_block* val;
+  regf_value_data vd;
+  int	visit, d, o;
+
+  rw->depth = 0;
+  if (!rw->stack_size && !grow_stack( rw ))
+  {
+    if (v->error)
+      v->error( ctx, rw, "insufficient memory" );
+    return;
+  }
+  for (;;)
+  {
+    if (key)
+    {
+      f = &rw->stack[rw->depth++];
+      f->key = key;
+      visit = (v->enter) ? v->enter( ctx, rw, key ) : REGF_VALUES | REGF_SUBKEYS;
+      if ((visit & REGF_VALUES) && v->value && key->value_count > 0)
+      {
+	val_list = regf_values( &rw->bins, key );
+	if (val_list)
+	  regf_prefetch( &rw->bins, val_list->offsets[0] );
+	for (o = 0; val_list && o < key->value_count; ++o)
+	{
+	  if (o + 1 < key->value_count)
+	    regf_prefetch( &rw->bins, val_list->offsets[o + 1] );
+	  val = regf_value( &rw->bins, val_list->offsets[o] );
+	  if (val && regf_data( &rw->bins, val, &vd ))
+	    v->value( ctx, rw, key, val, &vd );
+	  else if (v->error)
+	    v->error( ctx, rw, (val) ? "value data out of range"
+				     : "value out of range" );
+	}
+	if (!val_list && v->error)
+	  v->error( ctx, rw, "values out of range" );
+      }
+      if (visit & REGF_SUBKEYS)
+	regf_first_subkey( &rw->bins, key, &f->it );
+      else
+      {
+	f->it.list = NULL;
+	f->it.bad = 0;
+      }
+    }
+    else
+    {
+      if (v->leave)
+	v->leave( ctx, rw, f->key );
+      if (--rw->depth == 0)
+	break;
+      f = &rw->stack[rw->depth - 1];
+    }
+
+    key = regf_next_subkey( &rw->bins, &f->it );
+    if (f->it.bad)
+    {
+      if (v->error)
+	v->error( ctx, rw, "subkey out of range" );
+      f->it.bad = 0;
+    }
+    if (key)
+    {
+      for (d = 0; d < rw->depth && rw->stack[d].key != key; ++d) ;
+      if (d < rw->depth || rw->depth == REGF_MAX_DEPTH)
+      {
+	if (v->error)
+	  v->error( ctx, rw, (d < rw->depth) ? "subkey loops back to an ancestor"
+					      : "subkeys nested too deeply" );
+	key = NULL;
+      }
+      else if (rw->depth == rw->stack_size && !grow_stack( rw ))
+      {
+	if (v->error)
+	  v->error( ctx, rw, "insufficient memory" );
+	key = NULL;
+      }
+    }
+  }
+}
+
+
+// Write the path of the first DEPTH keys of the walk (or all of them, if DEPTH
+// is 0) to OUT in UTF-8, as "/ROOT/KEY/SUBKEY", returning its length.  If SIZE
+// isn't enough, nothing is written and the size needed is returned (which may
+// be a little more than the path).
+size_t regf_path( regf_walker* rw, int depth, char* out, size_t size )
+{
+  regf_key_block* key;
+  size_t need = 1;
+  char*  p = out;
+  int	 i;
+
+  if (depth <= 0 || depth > rw->depth)
+    depth = rw->depth;
+  for (i = 0; i < depth; ++i)
+  {
+    key = rw->stack[i].key;
+    need += 1 + ((key->flags & REGF_KEY_COMP_NAME) ? key->len * 2
+						    : key->len / 2 * 3);
+  }
+  if (need > size)
+    return need;
+
+  for (i = 0; i < depth; ++i)
+  {
+    key = rw->stack[i].key;
+    *p++ = '/';
+    p = regf_utf8( p, key->name, key->len, key->flags & REGF_KEY_COMP_NAME );
+  }
+  *p = '\0';
+  return p - out;
+}
+
+
+void regf_free( regf_walker* rw )
+{
+  free( rw->stack );
+  rw->stack = NULL;
+  rw->stack_size = 0;
+}
@@ -0,0 +1,260 @@
+/*
+  regf.h - Read a registry hive.
+
+  The hive reader of regdump, for programs that want the keys and values
+  themselves, rather than regdump's text.  A hive is loaded (mapped if
+  possible, with its transaction logs replayed if it's dirty) and then walked
+  with a visitor, whose functions are called for each key and value.  Nothing
+  is rendered by the walk; regf_path gives the path of a key when wanted.
+
+    regf_hive h;
+    regf_walker rw;
+    regf_visitor v = { enter, value, NULL, NULL };
+
+    if (regf_load( "NTUSER.DAT", &h, 1 ))
+    {
+      regf_walk( &rw, regf_start( &rw, &h ), &v, ctx );
+      regf_free( &rw );
+      regf_unload( &h );
+    }
+
+  Build regf.c as part of the program, or as a library of its own.
+*/
+
+#ifndef REGF_H
+#define REGF_H
+
+// Everything here starts with "regf_" (or "REGF_"), so it can be included
+// along with anything else; flags are plain ints.
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+# define REGF_INLINE static __inline
+#else
+# define REGF_INLINE static inline
+#endif
+
+// Ask for memory that will soon be read (it's only a hint).
+#if defined(__GNUC__)
+# define REGF_PREFETCH( p ) __builtin_prefetch( p )
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+# include <xmmintrin.h>
+# define REGF_PREFETCH( p ) _mm_prefetch( (const char*)(p), _MM_HINT_T0 )
+#else
+# define REGF_PREFETCH( p ) ((void)(p))
+#endif
+
+
+typedef struct
+{
+  char signature[4];		// "regf"
+  int  primary_sequence_number;
+  int  secondary_sequence_number;
+  int  last_written_timestamp[2];	// avoid alignment issues with int64_t
+  int  major_version;
+  int  minor_version;
+  int  file_type;
+  int  file_format;
+  int  root_cell_offset;
+  int  hive_bins_data_size;
+  // and more of no interest
+} regf_base_block;
+
+
+typedef struct
+{
+  int block_size;
+  int offsets[1];
+} regf_offsets;
+
+
+typedef struct
+{
+  int	block_size;
+  char	block_type[2];		// "lf" "lh" "li" "ri" "db"
+  short count;
+  int	offsets[1];		// "lf" "lh" follow each with a hash
+} regf_list_block;
+
+
+typedef struct
+{
+  int	  block_size;
+  char	  block_type[2];	// "nk"
+  short   flags;
+  int64_t timestamp;
+  int	  access_bits;
+  int	  parent;
+  int	  subkey_count;
+  char	  dummyb[4];
+  int	  subkeys;
+  char	  dummyc[4];
+  int	  value_count;
+  int	  values;
+  int	  security;
+  char	  dummyd[24];
+  short   len;
+  short   du;
+  char	  name[1];
+} regf_key_block;
+
+
+typedef struct
+{
+  int	block_size;
+  char	block_type[2];		// "vk"
+  short name_len;
+  int	size;
+  int	offset;
+  int	value_type;
+  short flags;
+  short dummy;
+  char	name[1];
+} regf_value_block;
+
+
+typedef struct
+{
+  int	block_size;
+  char	block_type[2];		// "sk"
+  short dummy;
+  int	flink, blink;		// the list of every security cell
+  int	refs;			// keys using it
+  int	size;			// of the descriptor
+  unsigned char descriptor[1];	// self-relative SECURITY_DESCRIPTOR
+} regf_security_block;
+
+
+// A hive loaded into memory, either mapped or read.
+typedef struct
+{
+  char*  data;
+  size_t size;
+  int	 mapped;
+  void*  map;			// the file mapping, on Windows
+  const char* errmsg;		// why it failed to load
+  int	 error; 		// errno, if errmsg is NULL
+} regf_hive;
+
+
+#define REGF_KEY_HIVE_ENTRY  0x04
+#define REGF_KEY_COMP_NAME   0x20
+#define REGF_VALUE_COMP_NAME 0x01
+
+
+// The hive bins, which every cell offset is relative to.  Offsets are taken
+// as unsigned, so a hive of up to 4GiB can be reached.
+typedef struct
+{
+  char*  root;			// start of the hive bins
+  size_t size;			// their size, as loaded
+  int	 big_data;		// hive version supports "db" lists
+} regf_bins;
+
+
+// Return the cell at OFF if the first SIZE bytes of it are within the bins,
+// otherwise NULL.  Every cell is reached through this, so a bad offset stops
+// at the key or value it's in, rather than reading wild memory.
+REGF_INLINE void* regf_cell( const regf_bins* b, int off, uint64_t size )
+{
+  return ((uint64_t)(unsigned)off + size <= b->size) ? b->root + (unsigned)off
+						     : NULL;
+}
+
+
+// Start reading the cell at OFF, if it's within the bins.  The cells of a key
+// are scattered about the hive, so the next one is fetched while the current
+// one is being used.
+REGF_INLINE void regf_prefetch( const regf_bins* b, int off )
+{
+  if ((unsigned)off < b->size)
+    REGF_PREFETCH( b->root + (unsigned)off );
+}
+
+
+// Position within a key's subkey lists.
+typedef struct
+{
+  regf_list_block* list;
+  regf_list_block* sub;		// the current list of an "ri"
+  int	      i, j;
+  int	      bad;		// subkeys skipped for being out of range
+} regf_subkey_iter;
+
+
+// Value data, which for big data is a list of segments rather than one block.
+#define REGF_DB_SEGMENT 16344
+
+typedef struct
+{
+  char* data;			// the data, or the first segment
+  int	size;
+  int*	segs;			// offsets of the big data segments, or NULL
+  char* root;
+} regf_value_data;
+
+
+// The registry itself limits keys to 512 levels.
+#define REGF_MAX_DEPTH 512
+
+typedef struct
+{
+  regf_key_block*  key;
+  regf_subkey_iter it;
+} regf_frame;
+
+// State of a walk through a hive.
+typedef struct
+{
+  regf_bins bins;
+  regf_frame* stack;		// the keys leading to the current one
+  int	  depth, stack_size;
+} regf_walker;
+
+// What to visit of a key, returned by the visitor's enter.
+#define REGF_VALUES  1
+#define REGF_SUBKEYS 2
+
+// The functions called by the walk, any of which may be NULL; CTX is passed
+// through.  The current key is at the top of the stack (RW->depth is 1 for
+// the key the walk started with).
+typedef struct
+{
+  int  (*enter)( void* ctx, regf_walker* rw, regf_key_block* key );
+  void (*value)( void* ctx, regf_walker* rw, regf_key_block* key,
+		 regf_value_block* val, regf_value_data* vd );
+  void (*leave)( void* ctx, regf_walker* rw, regf_key_block* key );
+  // A subkey or value of the current key has been skipped.
+  void (*error)( void* ctx, regf_walker* rw, const char* msg );
+} regf_visitor;
+
+
+int  regf_load( const char* name, regf_hive* h, int replay );
+void regf_unload( regf_hive* h );
+
+regf_key_block*   regf_key( const regf_bins* b, int off );
+regf_value_block* regf_value( const regf_bins* b, int off );
+regf_offsets*     regf_values( const regf_bins* b, regf_key_block* key );
+regf_security_block* regf_security( const regf_bins* b, int off );
+
+regf_list_block* regf_subkey_list( const regf_bins* b, int off );
+void regf_first_subkey( const regf_bins* b, regf_key_block* key,
+			regf_subkey_iter* it );
+regf_key_block* regf_next_subkey( const regf_bins* b, regf_subkey_iter* it );
+
+int   regf_data( const regf_bins* b, regf_value_block* val,
+		 regf_value_data* vd );
+int   regf_segment_count( regf_value_data* vd );
+char* regf_segment( regf_value_data* vd, int n, int* len );
+
+char* regf_utf8( char* out, char* in, int len, int comp );
+
+regf_key_block* regf_root( regf_bins* b, regf_hive* h );
+regf_key_block* regf_start( regf_walker* rw, regf_hive* h );
+void   regf_walk( regf_walker* rw, regf_key_block* key, const regf_visitor* v,
+		  void* ctx );
+size_t regf_path( regf_walker* rw, int depth, char* out, size_t size );
+void   regf_free( regf_walker* rw );
+
+#endif